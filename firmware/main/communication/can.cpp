@@ -14,12 +14,18 @@
 #include <stdlib.h>
 
 #include "can.hpp"
+#include "can_filter.hpp"
+#include "can_health.hpp"
+#include "can_time.hpp"
 #include "canbus.hpp"
+#include "commands.h"
 #include "config.h"
 #include "display/lcd.hpp"
 #include "driver/twai.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
@@ -28,10 +34,16 @@
 
 #define TAG "CAN"
 
-#define CAN_ADDRESS 0x3
-
 void CmdCallback(CanBus *dev, twai_message_t &rMsg)
 {
+    int64_t start_us = esp_timer_get_time();
+    // Health frames of other nodes carry the sender's address, not a destination: they are not commands
+    if (rMsg.identifier >= CAN_HEALTH_ID_BASE) { return; }
+    can_addr_match_t match = can_filter_match(rMsg.identifier);
+    if (match == CAN_ADDR_OTHER) {
+        ESP_LOGD(TAG, "Not for me: 0x%x", rMsg.identifier);
+        return;
+    }
     ESP_LOGW(TAG, "RxCallback! msgid: 0x%x", rMsg.identifier);
     ESP_LOGD(TAG, "Command!");
     ESP_LOGD(TAG, "Data for me!");
@@ -39,17 +51,69 @@ void CmdCallback(CanBus *dev, twai_message_t &rMsg)
              rMsg.data[2], rMsg.data[3], rMsg.data[4], rMsg.data[5], rMsg.data[6], rMsg.data[7]);
     // REGW(REG_CMD, rMsg.data[0]);
     // REGW(REG_ARG, rMsg.data[1]);
-    set_lcd(rMsg.data[0]);
+    switch (rMsg.data[0]) {
+        case CMD_CAN_SET_ADDRESS: {
+            // Only for this node: a group or broadcast frame would give all of them the same address
+            if (match != CAN_ADDR_NODE) {
+                ESP_LOGW(TAG, "Address change ignored, it is not addressed to the node");
+                break;
+            }
+            esp_err_t res = can_set_addresses(rMsg.data[1], rMsg.data[2]);
+            if (res != ESP_OK) {
+                ESP_LOGE(TAG, "Address change failed: %s", esp_err_to_name(res));
+                break;
+            }
+            ESP_LOGW(TAG, "Restarting with the new address...");
+            esp_restart();
+            break;
+        }
+        case CMD_TIME_SYNC:
+            can_time_on_sync(rMsg.data, start_us);
+            break;
+        case CMD_EXECUTE_AT:
+            can_time_on_execute_at(rMsg.data);
+            break;
+        case CMD_CAN_HEALTH_PERIOD:
+            can_health_set_period(rMsg.data[1] | (rMsg.data[2] << 8));
+            break;
+        case CMD_TIME_LOOPBACK_TEST:
+            can_time_start_loopback_test(rMsg.data[1]);
+            break;
+        default:
+            if (is_lcd_cmd(rMsg.data[0])) {
+                set_lcd(rMsg.data[0]);
+            } else {
+                ESP_LOGW(TAG, "Unknown command: 0x%x", rMsg.data[0]);
+            }
+            break;
+    }
+    can_health_note_rx((uint32_t) (esp_timer_get_time() - start_us));
+}
+
+esp_err_t can_transmit(const twai_message_t *msg)
+{
+    esp_err_t res = twai_transmit(msg, 0);
+    if (res == ESP_OK) {
+        can_health_note_tx();
+    } else {
+        ESP_LOGD(TAG, "Tx of 0x%x failed: %s", msg->identifier, esp_err_to_name(res));
+    }
+    return res;
 }
 
 esp_err_t start_can()
 {
 
+    can_filter_load();
+
     ESP_LOGI(TAG, "CAN start... (dev:0x%x)", (uint32_t) &devCanBus);
-    devCanBus.Start(CAN_ADDRESS, PIN_CANBUS_TX_ON_MODULE, PIN_CANBUS_RX_ON_MODULE);
+    devCanBus.Start(can_node_address(), PIN_CANBUS_TX_ON_MODULE, PIN_CANBUS_RX_ON_MODULE);
 
     ESP_LOGI(TAG, "Setting up the Store on receiving...");
     devCanBus.SetCallbackRxCmd(CmdCallback);
 
-    return ESP_OK;
+    // Keep the traffic for other nodes away from the CPU
+    can_filter_apply();
+
+    return start_can_health();
 }
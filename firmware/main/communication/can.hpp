@@ -17,11 +17,18 @@
 extern "C" {
 #endif
 
+#include "driver/twai.h"
 #include "esp_err.h"
 
+// Default node address, see can_filter.hpp
+#define CAN_ADDRESS 0x3
+
 extern uint8_t can_data_storage[8];
 esp_err_t      start_can();
 
+// Queue a frame for transmission without blocking and account it in the node health
+esp_err_t can_transmit(const twai_message_t *msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,158 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include "can.hpp"
+#include "can_filter.hpp"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "hal/twai_ll.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "soc/twai_struct.h"
+
+#define TAG "CAN_FILTER"
+
+#define NVS_NAMESPACE "can"
+#define NVS_KEY_NODE "node"
+#define NVS_KEY_GROUP "group"
+
+static uint8_t            node_address  = CAN_ADDRESS;
+static uint8_t            group_address = CAN_GROUP_ADDRESS;
+static can_filter_stats_t stats         = {};
+static portMUX_TYPE       stats_mux     = portMUX_INITIALIZER_UNLOCKED;
+
+twai_filter_config_t can_filter_config(uint8_t node, uint8_t group)
+{
+    // Dual filter mode, standard frames: filter 1 checks id bits in code/mask[31:21], filter 2 in code/mask[15:5].
+    // Mask bit 1 is "don't care".
+    uint32_t group_care = CAN_ADDRESS_MASK & ~(group ^ CAN_BROADCAST_ADDRESS);
+
+    twai_filter_config_t cfg;
+    cfg.acceptance_code = ((uint32_t) (node & CAN_ADDRESS_MASK) << 21) | ((uint32_t) (group & group_care) << 5);
+    cfg.acceptance_mask = ~(((uint32_t) CAN_ADDRESS_MASK << 21) | (group_care << 5));
+    cfg.single_filter   = false;
+    return cfg;
+}
+
+static esp_err_t nvs_init(void)
+{
+    esp_err_t res = nvs_flash_init();
+    if (res == ESP_ERR_NVS_NO_FREE_PAGES || res == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS is erased");
+        nvs_flash_erase();
+        res = nvs_flash_init();
+    }
+    return res;
+}
+
+esp_err_t can_filter_load(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t    res = nvs_init();
+    if (res == ESP_OK) { res = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs); }
+    if (res == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No stored addresses, defaults are used");
+        return ESP_OK;
+    }
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot open NVS: %s", esp_err_to_name(res));
+        return res;
+    }
+
+    uint8_t val;
+    if (nvs_get_u8(nvs, NVS_KEY_NODE, &val) == ESP_OK) { node_address = val & CAN_ADDRESS_MASK; }
+    if (nvs_get_u8(nvs, NVS_KEY_GROUP, &val) == ESP_OK) { group_address = val & CAN_ADDRESS_MASK; }
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "Node address: 0x%x, group: 0x%x", node_address, group_address);
+    return ESP_OK;
+}
+
+uint8_t can_node_address(void) { return node_address; }
+
+uint8_t can_group_address(void) { return group_address; }
+
+esp_err_t can_set_addresses(uint8_t node, uint8_t group)
+{
+    if (node > CAN_ADDRESS_MASK || group > CAN_ADDRESS_MASK || node == CAN_BROADCAST_ADDRESS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The running addresses stay as they are: the bus library got the node address at its start
+    nvs_handle_t nvs;
+    esp_err_t    res = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (res == ESP_OK) {
+        nvs_set_u8(nvs, NVS_KEY_NODE, node);
+        nvs_set_u8(nvs, NVS_KEY_GROUP, group);
+        res = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot store the addresses: %s", esp_err_to_name(res));
+        return res;
+    }
+    ESP_LOGI(TAG, "New node address: 0x%x, group: 0x%x, applied at the next start", node, group);
+    return ESP_OK;
+}
+
+esp_err_t can_filter_apply(void)
+{
+    // The filter can be changed only while the controller is in reset mode, which is what twai_stop() does.
+    // The driver and its queues stay installed, so whoever is waiting on them is not disturbed.
+    twai_filter_config_t cfg = can_filter_config(node_address, group_address);
+    esp_err_t            res = twai_stop();
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot stop TWAI: %s", esp_err_to_name(res));
+        return res;
+    }
+    twai_ll_set_acc_filter(&TWAI, cfg.acceptance_code, cfg.acceptance_mask, cfg.single_filter);
+    res = twai_start();
+    ESP_LOGI(TAG, "Filter code: 0x%08x, mask: 0x%08x", cfg.acceptance_code, cfg.acceptance_mask);
+    return res;
+}
+
+can_addr_match_t can_filter_match(uint32_t identifier)
+{
+    uint8_t          addr  = CAN_ID_ADDRESS(identifier);
+    can_addr_match_t match = CAN_ADDR_OTHER;
+    if (addr == node_address) {
+        match = CAN_ADDR_NODE;
+    } else if (addr == CAN_BROADCAST_ADDRESS) {
+        match = CAN_ADDR_BROADCAST;
+    } else if (addr == group_address) {
+        match = CAN_ADDR_GROUP;
+    }
+
+    portENTER_CRITICAL(&stats_mux);
+    switch (match) {
+        case CAN_ADDR_NODE:
+            stats.node++;
+            break;
+        case CAN_ADDR_GROUP:
+            stats.group++;
+            break;
+        case CAN_ADDR_BROADCAST:
+            stats.broadcast++;
+            break;
+        default:
+            stats.miss++;
+            break;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+    return match;
+}
+
+void can_filter_get_stats(can_filter_stats_t *out)
+{
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
@@ -0,0 +1,79 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "driver/twai.h"
+#include "esp_err.h"
+
+/*
+ Addressing. The destination address is in the low bits of the 11-bit frame id (CAN_ID_ADDRESS). A node accepts
+ frames for its own address, for its group and for the broadcast address. The addresses are kept in NVS.
+
+ The TWAI acceptance filter is programmed from the addresses, so other frames never reach the CPU: filter 1 matches
+ the node address, filter 2 matches the group and the broadcast address together. Address bits where the group
+ and the broadcast address differ are "don't care" for filter 2, so pick a group close to the broadcast address
+ (e.g. 0xE) to keep the filter tight. Frames that pass the filter but are not addressed to the node are counted as
+ misses and dropped in software.
+*/
+
+#define CAN_ADDRESS_MASK 0x0F
+#define CAN_ID_ADDRESS(id) ((id) & CAN_ADDRESS_MASK)
+#define CAN_BROADCAST_ADDRESS 0x0F
+
+#ifndef CAN_GROUP_ADDRESS
+#define CAN_GROUP_ADDRESS 0x0E  // all faces
+#endif
+
+typedef enum {
+    CAN_ADDR_NODE = 0,
+    CAN_ADDR_GROUP,
+    CAN_ADDR_BROADCAST,
+    CAN_ADDR_OTHER,
+} can_addr_match_t;
+
+typedef struct {
+    uint32_t node;       // frames for the node address
+    uint32_t group;      // frames for the group address
+    uint32_t broadcast;  // broadcast frames
+    uint32_t miss;       // frames that passed the hardware filter, but are not for the node
+} can_filter_stats_t;
+
+// Load the addresses from NVS. Defaults to CAN_ADDRESS and CAN_GROUP_ADDRESS.
+esp_err_t can_filter_load(void);
+
+uint8_t can_node_address(void);
+uint8_t can_group_address(void);
+
+// Store new addresses in NVS. They are applied by the next can_filter_load(), i.e. after a restart: the bus
+// library keeps the node address it was started with.
+esp_err_t can_set_addresses(uint8_t node, uint8_t group);
+
+// Program the acceptance filter of the running TWAI controller. Frames queued for TX are dropped.
+esp_err_t can_filter_apply(void);
+
+// Acceptance filter (dual filter mode) for the addresses
+twai_filter_config_t can_filter_config(uint8_t node, uint8_t group);
+
+// Classify a received frame by its address and account it in the statistics
+can_addr_match_t can_filter_match(uint32_t identifier);
+
+void can_filter_get_stats(can_filter_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,144 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include <string.h>
+
+#include "can.hpp"
+#include "can_filter.hpp"
+#include "can_health.hpp"
+#include "display/lcd.hpp"
+#include "driver/twai.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "CAN_HEALTH"
+
+// Counters collected between two health frames
+typedef struct {
+    uint32_t rx_cmds;
+    uint32_t tx_frames;
+    uint32_t rx_queue_hwm;
+    uint32_t callback_max_us;
+} health_period_t;
+
+static portMUX_TYPE       health_mux       = portMUX_INITIALIZER_UNLOCKED;
+static health_period_t    health_period    = {};
+static volatile uint32_t  health_period_ms = CAN_HEALTH_PERIOD_MS;
+static uint32_t           bus_off_events   = 0;
+static twai_state_t       last_state       = TWAI_STATE_RUNNING;
+static uint32_t           last_rx_dropped  = 0;
+
+static inline uint8_t saturate(uint32_t val, uint32_t max) { return (uint8_t) (val > max ? max : val); }
+
+void can_health_note_rx(uint32_t callback_us)
+{
+    portENTER_CRITICAL(&health_mux);
+    health_period.rx_cmds++;
+    if (callback_us > health_period.callback_max_us) { health_period.callback_max_us = callback_us; }
+    portEXIT_CRITICAL(&health_mux);
+}
+
+void can_health_note_tx(void)
+{
+    portENTER_CRITICAL(&health_mux);
+    health_period.tx_frames++;
+    portEXIT_CRITICAL(&health_mux);
+}
+
+void can_health_set_period(uint32_t period_ms) { health_period_ms = period_ms; }
+
+// Sample the TWAI driver state. Called more often than the frame is sent to catch the queue peaks and bus-off
+static void sample_twai(twai_status_info_t *status)
+{
+    if (twai_get_status_info(status) != ESP_OK) { return; }
+    if (status->state == TWAI_STATE_BUS_OFF && last_state != TWAI_STATE_BUS_OFF) {
+        bus_off_events++;
+        ESP_LOGW(TAG, "Bus-off! (events: %u)", bus_off_events);
+    }
+    last_state = status->state;
+
+    portENTER_CRITICAL(&health_mux);
+    if (status->msgs_to_rx > health_period.rx_queue_hwm) { health_period.rx_queue_hwm = status->msgs_to_rx; }
+    portEXIT_CRITICAL(&health_mux);
+}
+
+static void send_health(const twai_status_info_t *status, uint32_t elapsed_ms)
+{
+    health_period_t period;
+    portENTER_CRITICAL(&health_mux);
+    period = health_period;
+    memset(&health_period, 0, sizeof(health_period));
+    portEXIT_CRITICAL(&health_mux);
+
+    uint32_t rx_dropped        = status->rx_missed_count + status->rx_overrun_count;
+    uint32_t rx_dropped_period = rx_dropped - last_rx_dropped;
+    last_rx_dropped            = rx_dropped;
+    if (elapsed_ms == 0) { elapsed_ms = 1; }
+
+    twai_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.identifier       = CAN_HEALTH_ID_BASE | can_node_address();
+    msg.data_length_code = 8;
+    msg.data[0]          = saturate(period.rx_cmds * 1000 / elapsed_ms, 0xFF);
+    msg.data[1]          = saturate(period.tx_frames * 1000 / elapsed_ms, 0xFF);
+    msg.data[2]          = saturate(status->tx_error_counter, 0xFF);
+    msg.data[3]          = saturate(status->rx_error_counter, 0xFF);
+    msg.data[4]          = saturate(bus_off_events, 0xFF);
+    msg.data[5]          = saturate(period.rx_queue_hwm, 0xF) | (saturate(rx_dropped_period, 0xF) << 4);
+    msg.data[6]          = saturate(period.callback_max_us / 100, 0xFF);
+    msg.data[7]          = (is_lcd_busy() ? 0x80 : 0x00) | saturate(get_lcd(), 0x7F);
+
+    can_filter_stats_t filter;
+    can_filter_get_stats(&filter);
+    ESP_LOGD(TAG, "cmd:%u tx:%u tec:%u rec:%u busoff:%u hwm:%u drop:%u cb:%uus arb_lost:%u bus_err:%u", period.rx_cmds,
+             period.tx_frames, status->tx_error_counter, status->rx_error_counter, bus_off_events,
+             period.rx_queue_hwm, rx_dropped_period, period.callback_max_us, status->arb_lost_count,
+             status->bus_error_count);
+    ESP_LOGD(TAG, "filter hits node:%u group:%u broadcast:%u, misses:%u", filter.node, filter.group,
+             filter.broadcast, filter.miss);
+
+    // No point in queueing it while the controller is off the bus
+    if (status->state != TWAI_STATE_RUNNING) { return; }
+    can_transmit(&msg);
+}
+
+static void can_health_task(void *)
+{
+    const TickType_t   sample_ticks = (10 / portTICK_RATE_MS) ? (10 / portTICK_RATE_MS) : 1;
+    TickType_t         last_wake    = xTaskGetTickCount();
+    TickType_t         last_sent    = last_wake;
+    twai_status_info_t status;
+    memset(&status, 0, sizeof(status));
+
+    while (1) {
+        vTaskDelayUntil(&last_wake, sample_ticks);
+        uint32_t period_ms = health_period_ms;
+        if (period_ms == 0) {
+            last_sent = last_wake;
+            continue;
+        }
+        sample_twai(&status);
+
+        uint32_t elapsed_ms = (last_wake - last_sent) * portTICK_RATE_MS;
+        if (elapsed_ms >= period_ms) {
+            send_health(&status, elapsed_ms);
+            last_sent = last_wake;
+        }
+    }
+}
+
+esp_err_t start_can_health(void)
+{
+    BaseType_t res = xTaskCreate(&can_health_task, "can_health_task", 2048, NULL, 2, NULL);
+    return (res == pdPASS ? ESP_OK : ESP_FAIL);
+}
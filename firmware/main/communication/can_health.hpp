@@ -0,0 +1,57 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "esp_err.h"
+
+//Default period of the health frame. 0 disables it.
+#ifndef CAN_HEALTH_PERIOD_MS
+#define CAN_HEALTH_PERIOD_MS 1000
+#endif
+
+//Identifier of the health frame, the node address is added to it
+#define CAN_HEALTH_ID_BASE 0x700
+
+/*
+ Health frame layout (8 bytes, all counters saturate at their field width):
+   [0] commands received per second: frames for the node, its group or broadcast (the acceptance filter keeps
+       the rest of the bus traffic away, so the node does not see the bus rate)
+   [1] transmitted frames per second
+   [2] TWAI TX error counter
+   [3] TWAI RX error counter
+   [4] bus-off events since start
+   [5] bits 0..3: RX queue high-water mark over the period, bits 4..7: RX frames missed/overrun over the period
+   [6] longest RX callback execution over the period, in 100 us units
+   [7] display state: bit 7 - busy rendering, bits 0..6 - last displayed command (0x7F - none)
+*/
+
+// Start the task sending the health frame
+esp_err_t start_can_health(void);
+
+// Change the health frame period at runtime (CMD_CAN_HEALTH_PERIOD). 0 stops sending.
+void can_health_set_period(uint32_t period_ms);
+
+// Account a received command and the time its callback took
+void can_health_note_rx(uint32_t callback_us);
+
+// Account a transmitted frame
+void can_health_note_tx(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,308 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "can.hpp"
+#include "can_filter.hpp"
+#include "can_time.hpp"
+#include "commands.h"
+#include "display/lcd.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "CAN_TIME"
+
+// An error larger than this is a step of the master clock (e.g. it restarted), not a drift
+#define STEP_US 10000
+// Share of the error corrected at once: 1/PHASE_GAIN_DIV of the phase, 1/DRIFT_GAIN_DIV of the rate
+#define PHASE_GAIN_DIV 2
+#define DRIFT_GAIN_DIV 4
+#define DRIFT_MAX_PPB 500000
+#define PPB 1000000000LL
+
+#define SCHEDULED_MAX 4
+// Command of CMD_EXECUTE_AT that does nothing, only the skew is measured
+#define CMD_NONE 0xFF
+
+typedef struct {
+    esp_timer_handle_t timer;
+    int64_t            target_master_us;
+    uint8_t            cmd;
+    bool               used;
+} scheduled_t;
+
+static portMUX_TYPE     time_mux   = portMUX_INITIALIZER_UNLOCKED;
+static int64_t          ref_local  = 0;  // local time of the last correction
+static int64_t          ref_master = 0;  // master time at ref_local
+static can_time_stats_t stats      = {};
+static bool             master     = false;  // the master task runs
+static bool             master_end = false;  // the master task is asked to end
+static scheduled_t      scheduled[SCHEDULED_MAX];
+
+static inline int64_t unpack48(const uint8_t *data)
+{
+    int64_t val = 0;
+    for (int i = 5; i >= 0; i--) { val = (val << 8) | data[i]; }
+    return val;
+}
+
+static inline void pack48(uint8_t *data, int64_t val)
+{
+    for (int i = 0; i < 6; i++) { data[i] = (uint8_t) (val >> (8 * i)); }
+}
+
+// Must be called within time_mux
+static inline int64_t to_master(int64_t local_us)
+{
+    if (!stats.synced) return local_us;
+    int64_t d = local_us - ref_local;
+    return ref_master + d + d * stats.drift_ppb / PPB;
+}
+
+// Must be called within time_mux
+static inline int64_t to_local(int64_t master_us)
+{
+    if (!stats.synced) return master_us;
+    int64_t d = master_us - ref_master;
+    return ref_local + d - d * stats.drift_ppb / PPB;
+}
+
+static void rearm_scheduled(void);
+
+void can_time_on_sync(const uint8_t *data, int64_t rx_local_us)
+{
+    int64_t master_us = unpack48(&data[2]);
+
+    portENTER_CRITICAL(&time_mux);
+    int64_t predicted = to_master(rx_local_us);
+    int64_t err       = master_us - predicted;
+    int64_t elapsed   = rx_local_us - ref_local;
+    bool    step      = stats.synced && (llabs(err) > STEP_US || elapsed <= 0);
+    if (!stats.synced || step) {
+        //(Re)start from this frame
+        ref_master      = master_us;
+        stats.drift_ppb = stats.synced ? stats.drift_ppb : 0;
+        stats.synced    = true;
+    } else {
+        int64_t drift   = stats.drift_ppb + err * PPB / elapsed / DRIFT_GAIN_DIV;
+        stats.drift_ppb = (int32_t) (drift > DRIFT_MAX_PPB ? DRIFT_MAX_PPB
+                                                           : (drift < -DRIFT_MAX_PPB ? -DRIFT_MAX_PPB : drift));
+        ref_master      = predicted + err / PHASE_GAIN_DIV;
+    }
+    ref_local         = rx_local_us;
+    stats.sync_err_us = (int32_t) err;
+    stats.syncs++;
+    portEXIT_CRITICAL(&time_mux);
+
+    ESP_LOGD(TAG, "Sync #%u: err %d us, drift %d ppb", data[1], (int) err, stats.drift_ppb);
+    if (step) {
+        ESP_LOGW(TAG, "Master clock stepped by %d us", (int) err);
+        rearm_scheduled();
+    }
+}
+
+int64_t can_time_master_now(void)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&time_mux);
+    int64_t res = to_master(now);
+    portEXIT_CRITICAL(&time_mux);
+    return res;
+}
+
+static void execute(uint8_t cmd, int64_t target_master_us)
+{
+    int64_t now = esp_timer_get_time();
+    if (cmd != CMD_NONE) { set_lcd(cmd); }
+
+    portENTER_CRITICAL(&time_mux);
+    // The master knows the true master time, the others can only check against their model
+    int64_t skew = (master ? now : to_master(now)) - target_master_us;
+    stats.executed++;
+    stats.exec_skew_us = (int32_t) skew;
+    if (llabs(skew) > llabs(stats.exec_skew_max_us)) { stats.exec_skew_max_us = (int32_t) skew; }
+    portEXIT_CRITICAL(&time_mux);
+}
+
+static void scheduled_cb(void *arg)
+{
+    scheduled_t *slot = (scheduled_t *) arg;
+    execute(slot->cmd, slot->target_master_us);
+    slot->used = false;
+}
+
+void can_time_on_execute_at(const uint8_t *data)
+{
+    uint8_t cmd       = data[1];
+    int64_t target_us = unpack48(&data[2]);
+
+    //Without a sync frame there is no master time to wait for
+    portENTER_CRITICAL(&time_mux);
+    bool    synced = stats.synced;
+    int64_t delay  = to_local(target_us) - esp_timer_get_time();
+    portEXIT_CRITICAL(&time_mux);
+    if (!synced) {
+        execute(cmd, target_us);
+        return;
+    }
+
+    scheduled_t *slot = NULL;
+    for (int i = 0; i < SCHEDULED_MAX && slot == NULL; i++) {
+        if (!scheduled[i].used) { slot = &scheduled[i]; }
+    }
+    if (delay <= 0 || slot == NULL) {
+        ESP_LOGW(TAG, "Command 0x%x is executed now (%s)", cmd, slot == NULL ? "no free slot" : "too late");
+        execute(cmd, target_us);
+        return;
+    }
+
+    if (slot->timer == NULL) {
+        esp_timer_create_args_t args = {};
+        args.callback                = scheduled_cb;
+        args.arg                     = slot;
+        args.name                    = "can_exec_at";
+        if (esp_timer_create(&args, &slot->timer) != ESP_OK) {
+            execute(cmd, target_us);
+            return;
+        }
+    }
+    slot->cmd              = cmd;
+    slot->target_master_us = target_us;
+    slot->used             = true;
+    esp_timer_start_once(slot->timer, (uint64_t) delay);
+}
+
+//The model has jumped: the timers of the pending commands count to the old local time, start them again
+static void rearm_scheduled(void)
+{
+    for (int i = 0; i < SCHEDULED_MAX; i++) {
+        scheduled_t *slot = &scheduled[i];
+        //A timer that can't be stopped has fired already, its command is being executed
+        if (!slot->used || esp_timer_stop(slot->timer) != ESP_OK) continue;
+
+        portENTER_CRITICAL(&time_mux);
+        int64_t delay = to_local(slot->target_master_us) - esp_timer_get_time();
+        portEXIT_CRITICAL(&time_mux);
+        if (delay <= 0) {
+            scheduled_cb(slot);
+        } else {
+            esp_timer_start_once(slot->timer, (uint64_t) delay);
+        }
+    }
+}
+
+static esp_err_t send_time_frame(uint8_t cmd, uint8_t arg, int64_t time_us)
+{
+    twai_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.identifier       = CAN_TIME_ID;
+    msg.self             = 1;  // the sender acts on its own frames as everybody else
+    msg.data_length_code = 8;
+    msg.data[0]          = cmd;
+    msg.data[1]          = arg;
+    pack48(&msg.data[2], time_us);
+    return can_transmit(&msg);
+}
+
+static void master_task(void *arg)
+{
+    TickType_t period    = ((uint32_t) arg / portTICK_RATE_MS) ? ((uint32_t) arg / portTICK_RATE_MS) : 1;
+    TickType_t last_wake = xTaskGetTickCount();
+    uint8_t    seq       = 0;
+    while (1) {
+        //The decision to end and `master` change together, so a start meanwhile either keeps or restarts the task
+        portENTER_CRITICAL(&time_mux);
+        bool end = master_end;
+        if (end) { master = false; }
+        portEXIT_CRITICAL(&time_mux);
+        if (end) break;
+
+        send_time_frame(CMD_TIME_SYNC, seq++, esp_timer_get_time());
+        vTaskDelayUntil(&last_wake, period);
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t can_time_start_master(uint32_t period_ms)
+{
+    portENTER_CRITICAL(&time_mux);
+    bool running = master;
+    master_end   = false;
+    master       = true;
+    portEXIT_CRITICAL(&time_mux);
+    if (running) return ESP_OK;
+
+    BaseType_t res = xTaskCreate(&master_task, "can_time_master", 2048, (void *) period_ms, 6, NULL);
+    if (res != pdPASS) {
+        portENTER_CRITICAL(&time_mux);
+        master = false;
+        portEXIT_CRITICAL(&time_mux);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void can_time_stop_master(void)
+{
+    portENTER_CRITICAL(&time_mux);
+    if (master) { master_end = true; }
+    portEXIT_CRITICAL(&time_mux);
+}
+
+static void loopback_test_task(void *arg)
+{
+    int rounds = (int) (uint32_t) arg;
+
+    //A node that is not the master stays the master for the test only
+    portENTER_CRITICAL(&time_mux);
+    bool was_master = master && !master_end;
+    portEXIT_CRITICAL(&time_mux);
+    can_time_start_master(CAN_TIME_SYNC_PERIOD_MS);
+    vTaskDelay(3 * CAN_TIME_SYNC_PERIOD_MS / portTICK_RATE_MS);  // a few syncs to settle
+
+    portENTER_CRITICAL(&time_mux);
+    stats.executed         = 0;
+    stats.exec_skew_us     = 0;
+    stats.exec_skew_max_us = 0;
+    portEXIT_CRITICAL(&time_mux);
+
+    for (int i = 0; i < rounds; i++) {
+        send_time_frame(CMD_EXECUTE_AT, CMD_NONE, esp_timer_get_time() + 50000);
+        vTaskDelay(200 / portTICK_RATE_MS);
+    }
+
+    can_time_stats_t res;
+    can_time_get_stats(&res);
+    //The skew is against this node's own clock. It shows the scheduling latency and the error of the model built
+    //from its own sync frames, not the skew between nodes: that needs two boards and e.g. a scope on both.
+    ESP_LOGI(TAG, "Loopback test: %u/%d executed, skew last %d us, max %d us; model: sync err %d us, drift %d ppb",
+             res.executed, rounds, res.exec_skew_us, res.exec_skew_max_us, res.sync_err_us, res.drift_ppb);
+    if (!was_master) { can_time_stop_master(); }
+    vTaskDelete(NULL);
+}
+
+esp_err_t can_time_start_loopback_test(uint8_t rounds)
+{
+    BaseType_t res = xTaskCreate(&loopback_test_task, "can_time_test", 2048, (void *) (uint32_t) rounds, 3, NULL);
+    return (res == pdPASS ? ESP_OK : ESP_FAIL);
+}
+
+void can_time_get_stats(can_time_stats_t *out)
+{
+    portENTER_CRITICAL(&time_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&time_mux);
+}
@@ -0,0 +1,82 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "can_filter.hpp"
+#include "esp_err.h"
+
+/*
+ Time synchronization. A master node broadcasts CMD_TIME_SYNC frames with its clock (48-bit microseconds).
+ Every node, the master included (it receives its own frames by self-reception), keeps a model of the master
+ clock: an offset corrected on every sync frame and a drift estimated from the errors between them. Commands
+ sent as CMD_EXECUTE_AT carry the master time to execute them at and are run by a local timer at that time, so
+ all the nodes act together whatever the bus arbitration and their polling phase are.
+
+ Frame data (the first byte is the command code, as for any other command):
+   CMD_TIME_SYNC:          [1] sequence number, [2..7] master time, us, little-endian
+   CMD_EXECUTE_AT:         [1] command to execute, [2..7] master time to execute it at, us, little-endian
+   CMD_TIME_LOOPBACK_TEST: [1] number of rounds
+*/
+
+// Id of the frames the node sends as the time master; addressed to all the nodes
+#ifndef CAN_TIME_ID
+#define CAN_TIME_ID (0x100 | CAN_BROADCAST_ADDRESS)
+#endif
+
+#ifndef CAN_TIME_SYNC_PERIOD_MS
+#define CAN_TIME_SYNC_PERIOD_MS 500
+#endif
+
+typedef struct {
+    bool     synced;
+    uint32_t syncs;           // sync frames received
+    int32_t  sync_err_us;     // error of the clock model on the last sync frame
+    int32_t  drift_ppb;       // estimated drift of the master clock against the local one
+    uint32_t executed;        // scheduled commands executed
+    // How late the last scheduled command was run. The master measures it against its own (true) clock, the
+    // other nodes only against their model, so there it is the timer latency; see sync_err_us for the model.
+    int32_t  exec_skew_us;
+    int32_t  exec_skew_max_us;
+} can_time_stats_t;
+
+// Feed a received sync frame; rx_local_us is the local time the frame was received at
+void can_time_on_sync(const uint8_t *data, int64_t rx_local_us);
+
+// Schedule a command from a received CMD_EXECUTE_AT frame. Not synced yet, the command is executed at once.
+void can_time_on_execute_at(const uint8_t *data);
+
+// Master time now, or the local time while not synced
+int64_t can_time_master_now(void);
+
+// Become the time master: send sync frames every period_ms
+esp_err_t can_time_start_master(uint32_t period_ms);
+
+// Stop sending sync frames. The clock model keeps running on the frames of another master, if any.
+void can_time_stop_master(void);
+
+// Become the master for the test and send rounds of sync and CMD_EXECUTE_AT frames to this node by
+// self-reception, then log the achieved skew. A node that was not the master stops being it after the test. Runs in its own task. This checks one node against itself only; the skew between
+// nodes has to be measured on two boards.
+esp_err_t can_time_start_loopback_test(uint8_t rounds);
+
+void can_time_get_stats(can_time_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,6 +22,26 @@ extern "C" {
 #define CMD_HAPPY 0x33
 #define CMD_SAD 0x34
 
+/* Colour effects, applied to the current and all the following faces */
+#define CMD_FX_NONE 0x40
+#define CMD_FX_DIM 0x41
+#define CMD_FX_TIRED 0x42
+#define CMD_FX_ALERT 0x43
+
+/* Animation clips, in the order of FACE_CLIPS in the build */
+#define CMD_CLIP_FIRST 0x50
+
+/* Node configuration: data[1] - node address, data[2] - group address. Stored in NVS. */
+#define CMD_CAN_SET_ADDRESS 0x60
+
+/* Time synchronization and scheduled commands, see can_time.hpp */
+#define CMD_EXECUTE_AT 0x61
+#define CMD_TIME_SYNC 0x62
+#define CMD_TIME_LOOPBACK_TEST 0x63
+
+/* Health frame period: data[1..2] - period in ms, little-endian, 0 - stop sending. See can_health.hpp */
+#define CMD_CAN_HEALTH_PERIOD 0x64
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,162 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include <string.h>
+#include "clip.hpp"
+#include "color_lut.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lcd.hpp"
+
+#define TAG "Clip"
+
+//Size of a strip buffer, the same as a band
+#define STRIP_PX (LCD_SIZE_PX_X * PARALLEL_LINES)
+
+//RLE stream of a rectangle. Runs can cross strips, so the decoder keeps its state between calls.
+typedef struct {
+    const uint16_t *src;
+    const uint16_t *end;
+    uint16_t        run;
+    bool            repeat;
+    uint16_t        value;
+} rle_state_t;
+
+static bool rle_decode(rle_state_t *st, uint16_t *dest, int pixels_num)
+{
+    while (pixels_num > 0) {
+        if (st->run == 0) {
+            if (st->src >= st->end) return false;
+            uint16_t hdr = *st->src++;
+            st->repeat   = (hdr & 0x8000) != 0;
+            st->run      = (hdr & 0x7FFF) + 1;
+            if (st->repeat) {
+                if (st->src >= st->end) return false;
+                st->value = *st->src++;
+            }
+        }
+        int n = (st->run < pixels_num) ? st->run : pixels_num;
+        if (st->repeat) {
+            for (int i = 0; i < n; i++) { dest[i] = st->value; }
+        } else {
+            if (st->src + n > st->end) return false;
+            memcpy(dest, st->src, n * sizeof(uint16_t));
+            st->src += n;
+        }
+        st->run -= n;
+        dest += n;
+        pixels_num -= n;
+    }
+    return true;
+}
+
+//Send a rectangle to all the panels, strip by strip, double-buffered as the bands of a frame
+static esp_err_t send_rect(const uint16_t *rect, uint16_t **strips, int *calc_strip, send_abort_cb_t abort_cb)
+{
+    uint16_t x     = rect[0];
+    uint16_t y     = rect[1];
+    uint16_t w     = rect[2];
+    uint16_t h     = rect[3];
+    uint32_t words = rect[4] | ((uint32_t) rect[5] << 16);
+
+    if (w == 0 || h == 0 || x + w > LCD_SIZE_PX_X || y + h > LCD_SIZE_PX_Y) return ESP_ERR_INVALID_ARG;
+
+    rle_state_t st          = {};
+    st.src                  = rect + 6;
+    st.end                  = st.src + words;
+    int         strip_lines = STRIP_PX / w;
+
+    for (int y_cur = y; y_cur < y + h; y_cur += strip_lines) {
+        if (abort_cb != nullptr && abort_cb()) return ESP_FAIL;
+
+        int       lines = (y + h - y_cur < strip_lines) ? (y + h - y_cur) : strip_lines;
+        uint16_t *strip = strips[*calc_strip];
+        if (!rle_decode(&st, strip, lines * w)) return ESP_ERR_INVALID_ARG;
+        color_lut_apply(strip, lines * w);
+
+        //The same strip goes to every panel, the DMA only reads it
+        for (int p = 0; p < LCD_PANELS_NUM; p++) {
+            send_line_finish(&lcd_panels[p]);
+            send_window(&lcd_panels[p], x, y_cur, w, lines, strip);
+        }
+        *calc_strip = (*calc_strip == 1) ? 0 : 1;
+    }
+    return ESP_OK;
+}
+
+//Frames are paced by a timer: a tick (10 ms at 100 Hz) is too coarse for the frame rates of the clips
+static esp_timer_handle_t frame_timer = NULL;
+static SemaphoreHandle_t  frame_sem   = NULL;
+
+static void frame_timer_cb(void *) { xSemaphoreGive(frame_sem); }
+
+static esp_err_t frame_timer_init(void)
+{
+    if (frame_timer != NULL) return ESP_OK;
+    frame_sem = xSemaphoreCreateBinary();
+    if (frame_sem == NULL) return ESP_ERR_NO_MEM;
+    esp_timer_create_args_t args = {};
+    args.callback                = frame_timer_cb;
+    args.name                    = "clip_frame";
+    return esp_timer_create(&args, &frame_timer);
+}
+
+//Wait until the time, us. A frame that took longer than its time is not waited for.
+static void frame_wait_until(int64_t time_us)
+{
+    int64_t delay = time_us - esp_timer_get_time();
+    if (delay <= 0) return;
+    if (frame_timer_init() != ESP_OK) {
+        vTaskDelay(delay / 1000 / portTICK_RATE_MS);
+        return;
+    }
+    esp_timer_start_once(frame_timer, (uint64_t) delay);
+    xSemaphoreTake(frame_sem, portMAX_DELAY);
+}
+
+esp_err_t play_clip(const uint16_t *clip, send_abort_cb_t abort_cb)
+{
+    if (clip == NULL || clip[0] != FACE_CLIP_MAGIC || clip[1] == 0) return ESP_ERR_INVALID_ARG;
+
+    uint16_t        fps        = clip[1];
+    uint16_t        frames_num = clip[2];
+    const uint16_t *pos        = clip + 3;
+    esp_err_t       ret        = ESP_OK;
+    uint16_t       *strips[2];
+    int             calc_strip = 0;
+
+    for (int i = 0; i < 2; i++) {
+        strips[i] = static_cast<uint16_t *>(heap_caps_malloc(STRIP_PX * sizeof(uint16_t), MALLOC_CAP_DMA));
+        assert(strips[i] != NULL);
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    for (int f = 0; f < frames_num && ret == ESP_OK; f++) {
+        uint16_t rects_num = *pos++;
+        for (int r = 0; r < rects_num && ret == ESP_OK; r++) {
+            ret = send_rect(pos, strips, &calc_strip, abort_cb);
+            pos += 6 + (pos[4] | ((uint32_t) pos[5] << 16));
+        }
+        for (int p = 0; p < LCD_PANELS_NUM; p++) { send_line_finish(&lcd_panels[p]); }
+
+        //Show the frame for its time. The times are from the start of the clip, so rounding does not add up.
+        if (ret == ESP_OK && f + 1 < frames_num) { frame_wait_until(start_us + (int64_t) (f + 1) * 1000000 / fps); }
+    }
+
+    if (ret == ESP_ERR_INVALID_ARG) { ESP_LOGE(TAG, "Malformed clip"); }
+    for (int i = 0; i < 2; i++) { free(strips[i]); }
+    return ret;
+}
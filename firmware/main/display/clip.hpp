@@ -0,0 +1,27 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "face_clips.h"
+#include "spi.hpp"
+
+/* Play an animation clip made by tools/make_clips.py on all the panels. The keyframe is drawn in full, every next
+ * frame only updates its changed rectangles as windowed transfers. Frames are paced at the clip frame rate.
+ *
+ * Returns - ESP_ERR_INVALID_ARG if the clip is malformed
+ *         - ESP_FAIL if aborted by abort_cb (polled between the strips)
+ *         - ESP_OK when the last frame is shown
+ */
+esp_err_t play_clip(const uint16_t *clip, send_abort_cb_t abort_cb = nullptr);
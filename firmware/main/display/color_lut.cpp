@@ -0,0 +1,79 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include "color_lut.hpp"
+#include "esp_attr.h"
+
+#define LUT_R_SIZE 32
+#define LUT_G_SIZE 64
+#define LUT_B_SIZE 32
+
+//Channel gains of an effect, 256 = 1.0
+typedef struct {
+    uint16_t r;
+    uint16_t g;
+    uint16_t b;
+} fx_gains_t;
+
+static const fx_gains_t fx_gains[LCD_FX_MAX] = {
+    /* LCD_FX_NONE */ { 256, 256, 256 },
+    /* LCD_FX_DIM */ { 96, 96, 96 },
+    /* LCD_FX_TIRED, dimmed and cold */ { 150, 165, 220 },
+    /* LCD_FX_ALERT, red tint */ { 256, 140, 140 },
+};
+
+//Every entry is the channel value already shifted into its RGB565 position and byte-swapped for the LCD, so
+//a pixel is transformed by OR-ing three lookups.
+DRAM_ATTR static uint16_t luts[LCD_FX_MAX][LUT_R_SIZE + LUT_G_SIZE + LUT_B_SIZE];
+
+static lcd_fx_t fx_selected = LCD_FX_NONE;
+
+FORCE_INLINE_ATTR uint16_t swap_bytes(uint16_t v) { return (v >> 8) | (v << 8); }
+
+static inline uint16_t scale(uint16_t val, uint16_t gain, uint16_t max)
+{
+    uint32_t res = ((uint32_t) val * gain + 128) >> 8;
+    return res > max ? max : res;
+}
+
+void color_lut_init(void)
+{
+    for (int fx = 0; fx < LCD_FX_MAX; fx++) {
+        uint16_t *lut_r = luts[fx];
+        uint16_t *lut_g = lut_r + LUT_R_SIZE;
+        uint16_t *lut_b = lut_g + LUT_G_SIZE;
+        for (int i = 0; i < LUT_R_SIZE; i++) { lut_r[i] = swap_bytes(scale(i, fx_gains[fx].r, 0x1F) << 11); }
+        for (int i = 0; i < LUT_G_SIZE; i++) { lut_g[i] = swap_bytes(scale(i, fx_gains[fx].g, 0x3F) << 5); }
+        for (int i = 0; i < LUT_B_SIZE; i++) { lut_b[i] = swap_bytes(scale(i, fx_gains[fx].b, 0x1F)); }
+    }
+}
+
+void color_lut_select(lcd_fx_t fx)
+{
+    if (fx < LCD_FX_MAX) { fx_selected = fx; }
+}
+
+lcd_fx_t color_lut_selected(void) { return fx_selected; }
+
+void IRAM_ATTR color_lut_apply(uint16_t *pixels, int pixels_num)
+{
+    lcd_fx_t fx = fx_selected;
+    if (fx == LCD_FX_NONE) return;
+
+    const uint16_t *lut_r = luts[fx];
+    const uint16_t *lut_g = lut_r + LUT_R_SIZE;
+    const uint16_t *lut_b = lut_g + LUT_G_SIZE;
+    for (int i = 0; i < pixels_num; i++) {
+        uint16_t v = swap_bytes(pixels[i]);
+        pixels[i]  = lut_r[v >> 11] | lut_g[(v >> 5) & 0x3F] | lut_b[v & 0x1F];
+    }
+}
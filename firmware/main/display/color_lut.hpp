@@ -0,0 +1,38 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ Colour effects applied to the bands right before they are sent. Every effect is a set of per-channel RGB565
+ lookup tables, so tints and dimming cost one table lookup per channel and need neither extra images nor decoding.
+*/
+typedef enum {
+    LCD_FX_NONE = 0,
+    LCD_FX_DIM,
+    LCD_FX_TIRED,
+    LCD_FX_ALERT,
+    LCD_FX_MAX,
+} lcd_fx_t;
+
+//Precompute the lookup tables of all the effects
+void color_lut_init(void);
+
+//Select the effect for the next bands
+void color_lut_select(lcd_fx_t fx);
+
+lcd_fx_t color_lut_selected(void);
+
+//Transform the big-endian RGB565 pixels in place. Does nothing for LCD_FX_NONE.
+void color_lut_apply(uint16_t *pixels, int pixels_num);
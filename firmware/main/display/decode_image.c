@@ -12,58 +12,159 @@
 
 #include "decode_image.h"
 #include <string.h>
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_rom_tjpgd.h"
 #include "faces.h"
 
 const char *TAG = "ImageDec";
 
+//Let the decoder read the image right from the mapped flash instead of copying it into its input buffer
+#ifndef DECODE_ZERO_COPY
+#define DECODE_ZERO_COPY 1
+#endif
+
+//A block that takes longer than this to decode is counted as a stall (cache misses, a flash write...)
+#ifndef DECODE_STALL_CYCLES
+#define DECODE_STALL_CYCLES 100000
+#endif
+
+static decode_stats_t stats = {};
+
 //Data that is passed from the decoder function to the infunc/outfunc functions.
 typedef struct {
     const unsigned char *inData;   //Pointer to jpeg data
-    uint16_t             inPos;    //Current position in jpeg data
+    uint32_t             inPos;    //Current position in jpeg data
+    bool                 zeroCopy; //The decoder reads the jpeg data in place
+    uint32_t             mcuStart; //CPU cycle count when the decoder started on the current block
     uint16_t           **outData;  //Array of IMAGE_H pointers to arrays of IMAGE_W 16-bit pixel values
     int                  outW;     //Width of the resulting file
     int                  outH;     //Height of the resulting file
+    uint16_t            *outRect;  //Or, in the rect mode, rect.w x rect.h pixels of the rectangle
+    decode_rect_t        rect;     //The rectangle, in the rect mode
+    bool                 rectDone; //The decoder went past the rectangle and was stopped
+    decode_abort_cb_t    abortCb;  //Optional check to stop decoding
 } JpegDev;
 
 //Input function for jpeg decoder. Just returns bytes from the inData field of the JpegDev structure.
-static uint32_t infunc(esp_rom_tjpgd_dec_t *decoder, uint8_t *buf, uint32_t len)
+//In the zero-copy mode the decoder is pointed at the data already: the ROM decoder refills from `inbuf` as
+//`dp = inbuf; infunc(dp, len)`, so moving `inbuf` to the next chunk of the image here makes it read that in place.
+static uint32_t IRAM_ATTR infunc(esp_rom_tjpgd_dec_t *decoder, uint8_t *buf, uint32_t len)
 {
     //Read bytes from input file
     JpegDev *jd = (JpegDev *) decoder->device;
-    if (buf != NULL) { memcpy(buf, jd->inData + jd->inPos, len); }
+    if (buf != NULL && buf != jd->inData + jd->inPos) { memcpy(buf, jd->inData + jd->inPos, len); }
     jd->inPos += len;
+    if (jd->zeroCopy) { decoder->inbuf = (uint8_t *) jd->inData + jd->inPos; }
     return len;
 }
 
+//Account the decoding time of a block, called by the output functions
+FORCE_INLINE_ATTR void mcu_done(JpegDev *jd)
+{
+    uint32_t now    = esp_cpu_get_ccount();
+    uint32_t cycles = now - jd->mcuStart;
+    stats.mcus++;
+    if (cycles > DECODE_STALL_CYCLES) { stats.mcu_stalls++; }
+    if (cycles > stats.mcu_cycles_max) { stats.mcu_cycles_max = cycles; }
+}
+
+//The abort callback runs from flash, so it is polled once per row of blocks only, not from every block
+FORCE_INLINE_ATTR bool abort_poll(JpegDev *jd, const esp_rom_tjpgd_rect_t *rect)
+{
+    return rect->left == 0 && jd->abortCb != NULL && jd->abortCb();
+}
+
+//Convert the 3 bytes of RGB888 to a rgb565 value
+FORCE_INLINE_ATTR uint16_t rgb565_be(const uint8_t *in)
+{
+    uint16_t v = 0;
+    v |= ((in[0] >> 3) << 11);
+    v |= ((in[1] >> 2) << 5);
+    v |= ((in[2] >> 3) << 0);
+    //The LCD wants the 16-bit value in big-endian, so swap bytes
+    return (v >> 8) | (v << 8);
+}
+
 //Output function. Re-encodes the RGB888 data from the decoder as big-endian RGB565 and
 //stores it in the outData array of the JpegDev structure.
-static uint32_t outfunc(esp_rom_tjpgd_dec_t *decoder, void *bitmap, esp_rom_tjpgd_rect_t *rect)
+static uint32_t IRAM_ATTR outfunc(esp_rom_tjpgd_dec_t *decoder, void *bitmap, esp_rom_tjpgd_rect_t *rect)
 {
     JpegDev *jd = (JpegDev *) decoder->device;
     uint8_t *in = (uint8_t *) bitmap;
+    mcu_done(jd);
+    if (abort_poll(jd, rect)) { return 0; }  //Interrupts the decoder with JDR_INTR
     for (int y = rect->top; y <= rect->bottom; y++) {
         for (int x = rect->left; x <= rect->right; x++) {
-            //We need to convert the 3 bytes in `in` to a rgb565 value.
-            uint16_t v = 0;
-            v |= ((in[0] >> 3) << 11);
-            v |= ((in[1] >> 2) << 5);
-            v |= ((in[2] >> 3) << 0);
-            //The LCD wants the 16-bit value in big-endian, so swap bytes
-            v                 = (v >> 8) | (v << 8);
-            jd->outData[y][x] = v;
+            jd->outData[y][x] = rgb565_be(in);
             in += 3;
         }
     }
+    jd->mcuStart = esp_cpu_get_ccount();
+    return 1;
+}
+
+//Output function of the rect mode. Blocks come in the raster order, so the first block below the rectangle ends
+//the decoding. Blocks above and beside it are already decoded and converted by the ROM decoder when they get
+//here, they are only not copied. The rectangle is MCU-aligned: a block is either inside or outside.
+static uint32_t IRAM_ATTR outfunc_rect(esp_rom_tjpgd_dec_t *decoder, void *bitmap, esp_rom_tjpgd_rect_t *rect)
+{
+    JpegDev             *jd = (JpegDev *) decoder->device;
+    const decode_rect_t *r  = &jd->rect;
+    uint8_t             *in = (uint8_t *) bitmap;
+    mcu_done(jd);
+    if (abort_poll(jd, rect)) { return 0; }
+    if (rect->top >= r->y + r->h) {
+        jd->rectDone = true;
+        return 0;
+    }
+    if (rect->bottom >= r->y && rect->right >= r->x && rect->left < r->x + r->w) {
+        for (int y = rect->top; y <= rect->bottom; y++) {
+            uint16_t *out = jd->outRect + (y - r->y) * r->w + (rect->left - r->x);
+            for (int x = rect->left; x <= rect->right; x++) {
+                *out++ = rgb565_be(in);
+                in += 3;
+            }
+        }
+    }
+    jd->mcuStart = esp_cpu_get_ccount();
     return 1;
 }
 
+//Decode the prepared jpeg. The header has been read through the decoder's own buffer; the rest may come in place.
+static esp_rom_tjpgd_result_t decomp(esp_rom_tjpgd_dec_t *decoder, JpegDev *jd,
+                                     esp_rom_tjpgd_output_function_t out, uint8_t scale)
+{
+    jd->zeroCopy = DECODE_ZERO_COPY;
+    if (jd->zeroCopy) { decoder->inbuf = (uint8_t *) jd->inData + jd->inPos; }
+    jd->mcuStart = esp_cpu_get_ccount();
+    return esp_rom_tjpgd_decomp(decoder, out, scale);
+}
+
 //Size of the work space for the jpeg decoder.
 #define WORKSZ 3100
 
+int decode_image_width(uint8_t scale) { return (IMAGE_W + (1 << scale) - 1) >> scale; }
+
+int decode_image_height(uint8_t scale) { return (IMAGE_H + (1 << scale) - 1) >> scale; }
+
+void decode_image_free(uint16_t **pixels, uint8_t scale)
+{
+    if (pixels == NULL) return;
+    for (int i = 0; i < decode_image_height(scale); i++) { free(pixels[i]); }
+    free(pixels);
+}
+
+esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array, decode_abort_cb_t abort_cb)
+{
+    return decode_image_scaled(pixels, image_array, 0, abort_cb);
+}
+
 //Decode the embedded image into pixel lines that can be used with the rest of the logic.
-esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array)
+esp_err_t decode_image_scaled(uint16_t ***pixels, const uint8_t *image_array, uint8_t scale,
+                              decode_abort_cb_t abort_cb)
 {
     char               *work = NULL;
     int                 r;
@@ -71,16 +172,20 @@ esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array)
     JpegDev             jd;
     *pixels       = NULL;
     esp_err_t ret = ESP_OK;
+    int       w   = decode_image_width(scale);
+    int       h   = decode_image_height(scale);
+
+    if (scale > 3) { return ESP_ERR_INVALID_ARG; }
 
-    //Alocate pixel memory. Each line is an array of IMAGE_W 16-bit pixels; the `*pixels` array itself contains pointers to these lines.
-    *pixels = calloc(IMAGE_H, sizeof(uint16_t *));
+    //Alocate pixel memory. Each line is an array of w 16-bit pixels; the `*pixels` array itself contains pointers to these lines.
+    *pixels = calloc(h, sizeof(uint16_t *));
     if (*pixels == NULL) {
         ESP_LOGE(TAG, "Error allocating memory for lines");
         ret = ESP_ERR_NO_MEM;
         goto err;
     }
-    for (int i = 0; i < IMAGE_H; i++) {
-        (*pixels)[i] = malloc(IMAGE_W * sizeof(uint16_t));
+    for (int i = 0; i < h; i++) {
+        (*pixels)[i] = malloc(w * sizeof(uint16_t));
         if ((*pixels)[i] == NULL) {
             ESP_LOGE(TAG, "Error allocating memory for line %d", i);
             ret = ESP_ERR_NO_MEM;
@@ -97,11 +202,13 @@ esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array)
     }
 
     //Populate fields of the JpegDev struct.
+    memset(&jd, 0, sizeof(jd));
     jd.inData  = image_array;
     jd.inPos   = 0;
     jd.outData = *pixels;
-    jd.outW    = IMAGE_W;
-    jd.outH    = IMAGE_H;
+    jd.outW    = w;
+    jd.outH    = h;
+    jd.abortCb = abort_cb;
 
     //Prepare and decode the jpeg.
     r = esp_rom_tjpgd_prepare(&decoder, infunc, work, WORKSZ, (void *) &jd);
@@ -110,7 +217,12 @@ esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array)
         ret = ESP_ERR_NOT_SUPPORTED;
         goto err;
     }
-    r = esp_rom_tjpgd_decomp(&decoder, outfunc, 0);
+    r = decomp(&decoder, &jd, outfunc, scale);
+    if (r == JDR_INTR) {
+        ESP_LOGD(TAG, "Image decoder: aborted");
+        ret = ESP_FAIL;
+        goto err;
+    }
     if (r != JDR_OK && r != JDR_FMT1) {
         ESP_LOGE(TAG, "Image decoder: jd_decode failed (%d)", r);
         ret = ESP_ERR_NOT_SUPPORTED;
@@ -122,10 +234,83 @@ esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array)
     return ret;
 err:
     //Something went wrong! Exit cleanly, de-allocating everything we allocated.
-    if (*pixels != NULL) {
-        for (int i = 0; i < IMAGE_H; i++) { free((*pixels)[i]); }
-        free(*pixels);
+    decode_image_free(*pixels, scale);
+    *pixels = NULL;
+    free(work);
+    return ret;
+}
+
+static bool rect_aligned(uint16_t pos, uint16_t size, uint16_t mcu, uint16_t image_size)
+{
+    return size > 0 && pos % mcu == 0 && pos + size <= image_size && (size % mcu == 0 || pos + size == image_size);
+}
+
+esp_err_t decode_image_rect(uint16_t **pixels, const uint8_t *image_array, const decode_rect_t *rect,
+                            decode_abort_cb_t abort_cb)
+{
+    char               *work = NULL;
+    int                 r;
+    esp_rom_tjpgd_dec_t decoder;
+    JpegDev             jd;
+    *pixels       = NULL;
+    esp_err_t ret = ESP_OK;
+
+    work = calloc(WORKSZ, 1);
+    if (work == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate workspace");
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(&jd, 0, sizeof(jd));
+    jd.inData  = image_array;
+    jd.inPos   = 0;
+    jd.rect    = *rect;
+    jd.abortCb = abort_cb;
+
+    r = esp_rom_tjpgd_prepare(&decoder, infunc, work, WORKSZ, (void *) &jd);
+    if (r != JDR_OK) {
+        ESP_LOGE(TAG, "Image decoder: jd_prepare failed (%d)", r);
+        ret = ESP_ERR_NOT_SUPPORTED;
+        goto err;
     }
+    //The MCU size is only known from the header
+    if (!rect_aligned(rect->x, rect->w, decoder.msx * 8, decoder.width) ||
+        !rect_aligned(rect->y, rect->h, decoder.msy * 8, decoder.height)) {
+        ESP_LOGE(TAG, "Rect %dx%d at %d,%d is not aligned to the %dx%d MCU", rect->w, rect->h, rect->x, rect->y,
+                 decoder.msx * 8, decoder.msy * 8);
+        ret = ESP_ERR_INVALID_ARG;
+        goto err;
+    }
+
+    *pixels = heap_caps_malloc(rect->w * rect->h * sizeof(uint16_t), MALLOC_CAP_DMA);
+    if (*pixels == NULL) {
+        ESP_LOGE(TAG, "Error allocating memory for the rect");
+        ret = ESP_ERR_NO_MEM;
+        goto err;
+    }
+    jd.outRect = *pixels;
+
+    r = decomp(&decoder, &jd, outfunc_rect, 0);
+    if (r == JDR_INTR && !jd.rectDone) {
+        ESP_LOGD(TAG, "Image decoder: aborted");
+        ret = ESP_FAIL;
+        goto err;
+    }
+    if (r != JDR_OK && r != JDR_INTR && r != JDR_FMT1) {
+        ESP_LOGE(TAG, "Image decoder: jd_decode failed (%d)", r);
+        ret = ESP_ERR_NOT_SUPPORTED;
+        goto err;
+    }
+
+    free(work);
+    return ret;
+err:
+    free(*pixels);
+    *pixels = NULL;
     free(work);
     return ret;
 }
+
+void decode_image_stats_reset(void) { memset(&stats, 0, sizeof(stats)); }
+
+void decode_image_get_stats(decode_stats_t *out) { *out = stats; }
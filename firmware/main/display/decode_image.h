@@ -11,6 +11,7 @@
 // *************************************************************************
 
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 #include "esp_err.h"
 
@@ -18,17 +19,74 @@
 extern "C" {
 #endif
 
+//Returns true if decoding should be stopped.
+typedef bool (*decode_abort_cb_t)(void);
+
 /**
  * @brief Decode the jpeg ``image.jpg`` embedded into the program file into pixel data.
  *
  * @param pixels A pointer to a pointer for an array of rows, which themselves are an array of pixels.
  *        Effectively, you can get the pixel data by doing ``decode_image(&myPixels); pixelval=myPixels[ypos][xpos];``
  * @param image_array
+ * @param abort_cb Optional, polled for every decoded row of blocks. Decoding stops once it returns true.
  * @return - ESP_ERR_NOT_SUPPORTED if image is malformed or a progressive jpeg file
  *         - ESP_ERR_NO_MEM if out of memory
+ *         - ESP_FAIL if aborted by abort_cb
  *         - ESP_OK on succesful decode
  */
-esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array);
+esp_err_t decode_image(uint16_t ***pixels, const uint8_t *image_array, decode_abort_cb_t abort_cb);
+
+/**
+ * @brief Same as decode_image, but the image is downscaled by the decoder itself, which is much cheaper
+ *        than a full decode.
+ *
+ * @param scale 0 - 1/1, 1 - 1/2, 2 - 1/4, 3 - 1/8. The result is decode_image_width(scale) x decode_image_height(scale).
+ * @return - ESP_ERR_INVALID_ARG if the scale is not supported
+ *         - otherwise same as decode_image
+ */
+esp_err_t decode_image_scaled(uint16_t ***pixels, const uint8_t *image_array, uint8_t scale,
+                              decode_abort_cb_t abort_cb);
+
+//A rectangle of an image, in pixels of the full-size image
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} decode_rect_t;
+
+/**
+ * @brief Decode only a rectangle of the image into a single buffer of rect->w x rect->h pixels, row by row, ready
+ *        to be sent as a window. The ROM decoder still runs the IDCT and the colour conversion for every block
+ *        above and beside the rectangle, only copying them to the buffer is skipped. Decoding stops right after
+ *        the last block row of the rectangle, so only the blocks below it are saved: the cost is about
+ *        (rect bottom / image height) of a full decode.
+ *
+ * @param pixels Receives the buffer, DMA-capable. Free it with free().
+ * @param rect Must be aligned to the MCU of the image (8 or 16 pixels, depending on the chroma subsampling), the
+ *        right and the bottom edges may also be the image edges.
+ * @return - ESP_ERR_INVALID_ARG if the rectangle is not MCU-aligned or does not fit into the image
+ *         - otherwise same as decode_image
+ */
+esp_err_t decode_image_rect(uint16_t **pixels, const uint8_t *image_array, const decode_rect_t *rect,
+                            decode_abort_cb_t abort_cb);
+
+// Size of an image decoded with the scale
+int decode_image_width(uint8_t scale);
+int decode_image_height(uint8_t scale);
+
+// Free the pixels allocated by decode_image/decode_image_scaled
+void decode_image_free(uint16_t **pixels, uint8_t scale);
+
+//Decoding time of the blocks (MCUs) since the last decode_image_stats_reset()
+typedef struct {
+    uint32_t mcus;            //Decoded blocks
+    uint32_t mcu_stalls;      //Blocks that took longer than DECODE_STALL_CYCLES
+    uint32_t mcu_cycles_max;  //Longest block, CPU cycles
+} decode_stats_t;
+
+void decode_image_stats_reset(void);
+void decode_image_get_stats(decode_stats_t *out);
 
 #ifdef __cplusplus
 }
@@ -11,14 +11,18 @@
 // *************************************************************************
 
 #include <string.h>
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "driver/spi_master.h"
+#include "hal/gpio_ll.h"
 #include "pinout.hpp"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "faces.h"
 #include "communication/commands.h"
+#include "clip.hpp"
+#include "color_lut.hpp"
 
 #include "lcd.hpp"
 
@@ -118,12 +122,17 @@ DRAM_ATTR static const lcd_init_cmd_t ili_init_cmds[]={
     {0, {0}, 0xff},
 };
 
-static uint8_t command = 0xFFU;
+static volatile uint8_t command             = 0xFFU;
+static portMUX_TYPE     command_mux         = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t          displayed           = 0xFFU;
+static volatile bool    busy                = false;
+static bool             drawn               = false;  //The screen shows the whole `displayed` face
+static TaskHandle_t     display_task_handle = NULL;
 
 
-void lcd_cmd(const uint8_t cmd)
+void lcd_cmd(lcd_panel_t *panel, const uint8_t cmd)
 {
-    if (dev_lcdSpi == nullptr) {
+    if (panel->spi == nullptr) {
         printf("SPI is not initialized!\n");
         abort();
     }
@@ -132,14 +141,14 @@ void lcd_cmd(const uint8_t cmd)
     memset(&t, 0, sizeof(t));                                   //Zero out the transaction
     t.length    = 8;                                            //Command is 8 bits
     t.tx_buffer = &cmd;                                         //The data is the cmd itself
-    t.user      = (void *) 0;                                   //D/C needs to be set to 0
-    ret         = spi_device_polling_transmit(dev_lcdSpi, &t);  //Transmit!
+    t.user      = &panel->dc_cmd;                               //D/C needs to be set to 0
+    ret         = spi_device_polling_transmit(panel->spi, &t);  //Transmit!
     assert(ret == ESP_OK);                                      //Should have had no issues.
 }
 
-void lcd_data(const uint8_t *data, int len)
+void lcd_data(lcd_panel_t *panel, const uint8_t *data, int len)
 {
-    if (dev_lcdSpi == nullptr) {
+    if (panel->spi == nullptr) {
         printf("SPI is not initialized!\n");
         abort();
     }
@@ -149,65 +158,50 @@ void lcd_data(const uint8_t *data, int len)
     memset(&t, 0, sizeof(t));  //Zero out the transaction
     t.length    = len * 8;     //Len is in bytes, transaction length is in bits.
     t.tx_buffer = data;        //Data
-    t.user      = (void *) 1;  //D/C needs to be set to 1
-    ret         = spi_device_polling_transmit(dev_lcdSpi, &t);  //Transmit!
+    t.user      = &panel->dc_data;  //D/C needs to be set to 1
+    ret         = spi_device_polling_transmit(panel->spi, &t);  //Transmit!
     assert(ret == ESP_OK);                                      //Should have had no issues.
 }
 
-void lcd_spi_pre_transfer_callback(spi_transaction_t *t)
+void IRAM_ATTR lcd_spi_pre_transfer_callback(spi_transaction_t *t)
 {
-    int dc = (int) t->user;
-    gpio_set_level(PIN_NUM_DC, dc);
+    //gpio_set_level() lives in flash, the low-level call is inlined
+    const lcd_dc_t *dc = (const lcd_dc_t *) t->user;
+    gpio_ll_set_level(&GPIO, dc->pin, dc->level);
 }
 
-uint32_t lcd_get_id()
+uint32_t lcd_get_id(lcd_panel_t *panel)
 {
-    if (dev_lcdSpi == nullptr) {
+    if (panel->spi == nullptr) {
         printf("SPI is not initialized!\n");
         abort();
     }
     //get_id cmd
-    lcd_cmd(0x04);
+    lcd_cmd(panel, 0x04);
 
     spi_transaction_t t;
     memset(&t, 0, sizeof(t));
     t.length = 8 * 3;
     t.flags  = SPI_TRANS_USE_RXDATA;
-    t.user   = (void *) 1;
+    t.user   = &panel->dc_data;
 
-    esp_err_t ret = spi_device_polling_transmit(dev_lcdSpi, &t);
+    esp_err_t ret = spi_device_polling_transmit(panel->spi, &t);
     assert(ret == ESP_OK);
 
     return *(uint32_t *) t.rx_data;
 }
 
-void init_lcd()
+static void init_lcd_panel(lcd_panel_t *panel)
 {
-    if (dev_lcdSpi == nullptr) {
-        printf("SPI is not initialized!\n");
-        abort();
-    }
-
     int                   cmd = 0;
     const lcd_init_cmd_t *lcd_init_cmds;
 
-    //Initialize non-SPI GPIOs
-    gpio_set_direction(PIN_NUM_DC, GPIO_MODE_OUTPUT);
-    gpio_set_direction(PIN_NUM_RST, GPIO_MODE_OUTPUT);
-    gpio_set_direction(PIN_NUM_BCKL, GPIO_MODE_OUTPUT);
-
-    //Reset the display
-    gpio_set_level(PIN_NUM_RST, 0);
-    vTaskDelay(100 / portTICK_RATE_MS);
-    gpio_set_level(PIN_NUM_RST, 1);
-    vTaskDelay(100 / portTICK_RATE_MS);
-
     //detect LCD type
-    uint32_t lcd_id            = lcd_get_id();
+    uint32_t lcd_id            = lcd_get_id(panel);
     int      lcd_detected_type = 0;
     int      lcd_type          = 0;
 
-    printf("LCD ID: %08X\n", lcd_id);
+    printf("LCD (%s) ID: %08X\n", panel->name, lcd_id);
     if (lcd_id == 0) {
         //zero, ili
         lcd_detected_type = LCD_TYPE_ILI;
@@ -237,56 +231,168 @@ void init_lcd()
 
     //Send all the commands
     while (lcd_init_cmds[cmd].databytes != 0xff) {
-        lcd_cmd(lcd_init_cmds[cmd].cmd);
-        lcd_data(lcd_init_cmds[cmd].data, lcd_init_cmds[cmd].databytes & 0x1F);
+        lcd_cmd(panel, lcd_init_cmds[cmd].cmd);
+        lcd_data(panel, lcd_init_cmds[cmd].data, lcd_init_cmds[cmd].databytes & 0x1F);
         if (lcd_init_cmds[cmd].databytes & 0x80) { vTaskDelay(100 / portTICK_RATE_MS); }
         cmd++;
     }
+}
+
+void init_lcd()
+{
+    for (int i = 0; i < LCD_PANELS_NUM; i++) {
+        if (lcd_panels[i].spi == nullptr) {
+            printf("SPI is not initialized!\n");
+            abort();
+        }
+    }
+
+    //Initialize non-SPI GPIOs
+    for (int i = 0; i < LCD_PANELS_NUM; i++) { gpio_set_direction(lcd_panels[i].pin_dc, GPIO_MODE_OUTPUT); }
+    gpio_set_direction(PIN_NUM_RST, GPIO_MODE_OUTPUT);
+    gpio_set_direction(PIN_NUM_BCKL, GPIO_MODE_OUTPUT);
+
+    //Reset the displays. The reset line is shared, so it is done once for all the panels
+    gpio_set_level(PIN_NUM_RST, 0);
+    vTaskDelay(100 / portTICK_RATE_MS);
+    gpio_set_level(PIN_NUM_RST, 1);
+    vTaskDelay(100 / portTICK_RATE_MS);
+
+    for (int i = 0; i < LCD_PANELS_NUM; i++) { init_lcd_panel(&lcd_panels[i]); }
 
     ///Enable backlight
     gpio_set_level(PIN_NUM_BCKL, 0);
 }
 
+face_t face_image(uint8_t cmd)
+{
+    switch (cmd) {
+        case CMD_CALM:
+            return FACE(CALM);
+        case CMD_BLINK:
+            return FACE(BLINK);
+        case CMD_ANGRY:
+            return FACE(ANGRY);
+        case CMD_HAPPY:
+            return FACE(HAPPY);
+        case CMD_SAD:
+            return FACE(SAD);
+        default:
+            return NULL;
+    }
+}
+
+static inline bool is_fx_cmd(uint8_t cmd) { return cmd >= CMD_FX_NONE && cmd < CMD_FX_NONE + LCD_FX_MAX; }
+
+static inline bool is_clip_cmd(uint8_t cmd) { return cmd >= CMD_CLIP_FIRST && cmd < CMD_CLIP_FIRST + FACE_CLIPS_NUM; }
+
+bool is_lcd_cmd(uint8_t cmd) { return face_image(cmd) != NULL || is_fx_cmd(cmd) || is_clip_cmd(cmd); }
+
+//Abort check of the frame in progress. Only a command that redraws the whole screen (a clip starts with a full
+//keyframe) makes the frame obsolete;
+//the screen is consistent again once that command is drawn. Other commands wait for the frame to finish.
+static bool is_redraw_pending(void)
+{
+    uint8_t cmd = command;
+    return face_image(cmd) != NULL || is_fx_cmd(cmd) || is_clip_cmd(cmd);
+}
+
+//Abort check of a clip. An effect redraws the displayed face, and there is none while a clip plays, so the effect
+//waits for the clip to end; only a face or another clip make it obsolete.
+static bool is_clip_obsolete(void)
+{
+    uint8_t cmd = command;
+    return face_image(cmd) != NULL || is_clip_cmd(cmd);
+}
+
+//Only a part of the face has to be redrawn to show the next one
+//FACE_BLINK_RECT is "x,y,w,h" of the only part (in image pixels, MCU-aligned) where CALM and BLINK differ. It is
+//a property of the face assets, so it is not defined by default: the whole face is redrawn.
+static bool is_partial_update(uint8_t next, decode_rect_t *rect)
+{
+#ifdef FACE_BLINK_RECT
+    static const decode_rect_t blink_rect = { FACE_BLINK_RECT };
+    if (drawn && ((displayed == CMD_CALM && next == CMD_BLINK) || (displayed == CMD_BLINK && next == CMD_CALM))) {
+        *rect = blink_rect;
+        return true;
+    }
+#endif
+    return false;
+}
+
+//Take the pending command before drawing it, so a newer one may come in meanwhile. set_lcd() runs in other tasks
+//(CAN, esp_timer), so the read and the clear must not be split by it.
+static uint8_t take_command(void)
+{
+    portENTER_CRITICAL(&command_mux);
+    uint8_t cmd = command;
+    command     = 0xFF;
+    portEXIT_CRITICAL(&command_mux);
+    return cmd;
+}
+
 static void display_task(void *)
 {
     while (1) {
-        if (command != 0xFF) {
-            // ESP_LOGW("New Command: 0x%x", command);
-            printf("New Command: 0x%x\n", command);
-            switch (command) {
-                case CMD_CALM:
-                    send_image(dev_lcdSpi, CALM_JPG);
-                    break;
-                case CMD_BLINK:
-                    send_image(dev_lcdSpi, BLINK_JPG);
-                    break;
-                case CMD_ANGRY:
-                    send_image(dev_lcdSpi, ANGRY_JPG);
-                    break;
-                case CMD_HAPPY:
-                    send_image(dev_lcdSpi, HAPPY_JPG);
-                    break;
-                case CMD_SAD:
-                    send_image(dev_lcdSpi, SAD_JPG);
-                    break;
-                default:
-                    break;
+        uint8_t cmd = take_command();
+        if (cmd != 0xFF) {
+            // ESP_LOGW("New Command: 0x%x", cmd);
+            printf("New Command: 0x%x\n", cmd);
+            busy = true;
+
+            face_t        img = NULL;
+            decode_rect_t rect;
+            if (is_clip_cmd(cmd)) {
+                //The last frame of the clip stays on the screen
+                if (play_clip(face_clips[cmd - CMD_CLIP_FIRST], is_clip_obsolete) == ESP_FAIL) {
+                    printf("Clip 0x%x preempted\n", cmd);
+                }
+                //The screen shows the clip now, not a face: an effect has nothing to redraw until the next face
+                displayed = cmd;
+                drawn     = false;
+            } else if (is_fx_cmd(cmd)) {
+                //Redraw the current face with the new effect. It is still decoded, so only the bands are sent.
+                color_lut_select(static_cast<lcd_fx_t>(cmd - CMD_FX_NONE));
+                img = face_image(displayed);
+            } else if (face_image(cmd) != NULL && is_partial_update(cmd, &rect)) {
+                displayed = cmd;
+                drawn     = send_image_rect_all(face_image(cmd), rect, is_redraw_pending);
+                if (!drawn) { printf("Command 0x%x preempted\n", cmd); }
+            } else {
+                img = face_image(cmd);
+                if (img != NULL) { displayed = cmd; }
+            }
+            if (img != NULL) {
+                drawn = send_image_all(img, is_redraw_pending);
+                if (!drawn) { printf("Command 0x%x preempted\n", cmd); }
             }
 
-            command = 0xFF;
+            busy = false;
         }
-        vTaskDelay(1);
+        //Sleep until set_lcd() wakes us up. A command set while drawing has left a notification, so it is not missed.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
 
-void set_lcd(uint8_t val) { command = val; }
+void set_lcd(uint8_t val)
+{
+    portENTER_CRITICAL(&command_mux);
+    command = val;
+    portEXIT_CRITICAL(&command_mux);
+    if (display_task_handle != NULL) { xTaskNotifyGive(display_task_handle); }
+}
+
+uint8_t get_lcd(void) { return displayed; }
+
+bool is_lcd_busy(void) { return busy; }
 
 
 esp_err_t start_display(void)
 {
     init_spi();
     init_lcd();
+    color_lut_init();
 
-    BaseType_t res = xTaskCreatePinnedToCore(&display_task, "display_task", 4096, NULL, 5, NULL, 1);
+    BaseType_t res = xTaskCreatePinnedToCore(&display_task, "display_task", 4096, NULL, 5, &display_task_handle, 1);
     return (res == pdTRUE ? ESP_OK : ESP_FAIL);
 }
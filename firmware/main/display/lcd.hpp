@@ -44,7 +44,7 @@ typedef enum {
  * mode for higher speed. The overhead of interrupt transactions is more than
  * just waiting for the transaction to complete.
  */
-void lcd_cmd(const uint8_t cmd);
+void lcd_cmd(lcd_panel_t *panel, const uint8_t cmd);
 
 /* Send data to the LCD. Uses spi_device_polling_transmit, which waits until the
  * transfer is complete.
@@ -53,18 +53,30 @@ void lcd_cmd(const uint8_t cmd);
  * mode for higher speed. The overhead of interrupt transactions is more than
  * just waiting for the transaction to complete.
  */
-void lcd_data(const uint8_t *data, int len);
+void lcd_data(lcd_panel_t *panel, const uint8_t *data, int len);
 
 //This function is called (in irq context!) just before a transmission starts. It will
-//set the D/C line to the value indicated in the user field.
+//set the D/C line of the transaction's panel to the lcd_dc_t indicated in the user field.
 void lcd_spi_pre_transfer_callback(spi_transaction_t *t);
 
-uint32_t lcd_get_id();
+uint32_t lcd_get_id(lcd_panel_t *panel);
 
-//Initialize the display
+//Initialize the displays: reset all panels at once and send the init sequence to each of them
 void init_lcd();
 
 // Init display and start its task
 esp_err_t start_display(void);
 
 void set_lcd(uint8_t val);
+
+// Face of a command, NULL if the command is not a face
+face_t face_image(uint8_t cmd);
+
+// Whether set_lcd() can do something with the command: a face, a colour effect or a clip
+bool is_lcd_cmd(uint8_t cmd);
+
+// Last displayed command, 0xFF if nothing has been displayed yet
+uint8_t get_lcd(void);
+
+// Whether the display task is rendering a frame right now
+bool is_lcd_busy(void);
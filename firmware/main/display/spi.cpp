@@ -11,88 +11,137 @@
 // *************************************************************************
 
 #include <string.h>
+#include "color_lut.hpp"
 #include "decode_image.h"
 #include "driver/spi_master.h"
+#include "esp_attr.h"
+#include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "faces.h"
 #include "lcd.hpp"
 #include "pinout.hpp"
 #include "spi.hpp"
+#ifdef FACE_TILE_ATLAS
+#include "tiles.hpp"
+#endif
+
+#define TAG "SPI"
+
+//A band that takes SEND_STALL_FACTOR times longer to calculate than the fastest one of the same kind (colour effect,
+//preview scale) is counted as a stall: the calculation is a plain copy, so the difference is waiting for memory
+//(cache misses, a flash write...)
+#ifndef SEND_STALL_FACTOR
+#define SEND_STALL_FACTOR 2
+#endif
+
+static send_frame_stats_t frame_stats = {};
+static uint32_t           band_us_min[LCD_FX_MAX][4];  //Fastest band per colour effect and scale, 0 - none yet
+
+
+lcd_panel_t lcd_panels[LCD_PANELS_NUM] = {
+    {
+            .name    = "left",
+            .pin_cs  = PIN_NUM_CS,
+            .pin_dc  = PIN_NUM_DC,
+            .spi     = nullptr,
+            .dc_cmd  = { PIN_NUM_DC, 0 },
+            .dc_data = { PIN_NUM_DC, 1 },
+    },
+#if LCD_PANELS_NUM > 1
+    {
+            .name    = "right",
+            .pin_cs  = PIN_NUM_CS_R,
+            .pin_dc  = PIN_NUM_DC_R,
+            .spi     = nullptr,
+            .dc_cmd  = { PIN_NUM_DC_R, 0 },
+            .dc_data = { PIN_NUM_DC_R, 1 },
+    },
+#endif
+};
 
 
 void init_spi()
 {
-    esp_err_t                     ret;
-    spi_bus_config_t              buscfg = { .mosi_io_num     = PIN_NUM_MOSI,
-                                             .miso_io_num     = PIN_NUM_MISO,
-                                             .sclk_io_num     = PIN_NUM_CLK,
-                                             .quadwp_io_num   = -1,
-                                             .quadhd_io_num   = -1,
-                                             .max_transfer_sz = PARALLEL_LINES * LCD_SIZE_PX_X * 2 + 8 };
-    spi_device_interface_config_t devcfg = {
-        .mode = 0,  //SPI mode 0
-#ifdef CONFIG_LCD_OVERCLOCK
-        .clock_speed_hz = 26 * 1000 * 1000,  //Clock out at 26 MHz
-#else
-        .clock_speed_hz = 10 * 1000 * 1000,  //Clock out at 10 MHz
-#endif
-        .spics_io_num = PIN_NUM_CS,                     //CS pin
-        .queue_size   = 7,                              //We want to be able to queue 7 transactions at a time
-        .pre_cb       = lcd_spi_pre_transfer_callback,  //Specify pre-transfer callback to handle D/C line
-    };
+    esp_err_t        ret;
+    spi_bus_config_t buscfg = { .mosi_io_num     = PIN_NUM_MOSI,
+                                .miso_io_num     = PIN_NUM_MISO,
+                                .sclk_io_num     = PIN_NUM_CLK,
+                                .quadwp_io_num   = -1,
+                                .quadhd_io_num   = -1,
+                                .max_transfer_sz = PARALLEL_LINES * LCD_SIZE_PX_X * 2 + 8 };
 
     //Initialize the SPI bus
     ret = spi_bus_initialize(LCD_HOST, &buscfg, SPI_DMA_CH_AUTO);
     ESP_ERROR_CHECK(ret);
 
-    //Attach the LCD to the SPI bus
-    ret = spi_bus_add_device(LCD_HOST, &devcfg, &dev_lcdSpi);
-    ESP_ERROR_CHECK(ret);
+    //Attach the LCDs to the SPI bus
+    for (int i = 0; i < LCD_PANELS_NUM; i++) {
+        spi_device_interface_config_t devcfg = {
+            .mode = 0,  //SPI mode 0
+#ifdef CONFIG_LCD_OVERCLOCK
+            .clock_speed_hz = 26 * 1000 * 1000,  //Clock out at 26 MHz
+#else
+            .clock_speed_hz = 10 * 1000 * 1000,  //Clock out at 10 MHz
+#endif
+            .spics_io_num = lcd_panels[i].pin_cs,           //CS pin
+            .queue_size   = 7,                              //We want to be able to queue 7 transactions at a time
+            .pre_cb       = lcd_spi_pre_transfer_callback,  //Specify pre-transfer callback to handle D/C line
+        };
+        ret = spi_bus_add_device(LCD_HOST, &devcfg, &lcd_panels[i].spi);
+        ESP_ERROR_CHECK(ret);
+    }
+}
+
+void send_lines(lcd_panel_t *panel, int ypos, uint16_t y_lines_num, uint16_t *linedata)
+{
+    send_window(panel, 0, ypos, LCD_SIZE_PX_X, y_lines_num, linedata);
 }
 
-void send_lines(spi_device_handle_t spi, int ypos, uint16_t y_lines_num, uint16_t *linedata)
+void send_window(lcd_panel_t *panel, int xpos, int ypos, uint16_t width, uint16_t height, uint16_t *data)
 {
     esp_err_t ret;
     int       x;
-    //Transaction descriptors. Declared static so they're not allocated on the stack; we need this memory even when this
-    //function is finished because the SPI driver needs access to it even while we're already calculating the next line.
-    static spi_transaction_t trans[6];
+    //Transaction descriptors live in the panel; we need this memory even when this function is finished because
+    //the SPI driver needs access to it even while we're already calculating the next line.
+    spi_transaction_t *trans = panel->trans;
 
     //In theory, it's better to initialize trans and data only once and hang on to the initialized
-    //variables. We allocate them on the stack, so we need to re-init them each call.
+    //variables. We re-use them for every band, so we need to re-init them each call.
     for (x = 0; x < 6; x++) {
         memset(&trans[x], 0, sizeof(spi_transaction_t));
         if ((x & 1) == 0) {
             //Even transfers are commands
             trans[x].length = 8;
-            trans[x].user   = (void *) 0;
+            trans[x].user   = &panel->dc_cmd;
         } else {
             //Odd transfers are data
             trans[x].length = 8 * 4;
-            trans[x].user   = (void *) 1;
+            trans[x].user   = &panel->dc_data;
         }
         trans[x].flags = SPI_TRANS_USE_TXDATA;
     }
-    trans[0].tx_data[0] = 0x2A;                                 //Column Address Set
-    trans[1].tx_data[0] = 0;                                    //Start Col High
-    trans[1].tx_data[1] = 0;                                    //Start Col Low
-    trans[1].tx_data[2] = (LCD_SIZE_PX_X) >> 8;                 //End Col High
-    trans[1].tx_data[3] = (LCD_SIZE_PX_X) &0xff;                //End Col Low
-    trans[2].tx_data[0] = 0x2B;                                 //Page address set
-    trans[3].tx_data[0] = ypos >> 8;                            //Start page high
-    trans[3].tx_data[1] = ypos & 0xff;                          //start page low
-    trans[3].tx_data[2] = (ypos + y_lines_num) >> 8;            //end page high
-    trans[3].tx_data[3] = (ypos + y_lines_num) & 0xff;          //end page low
-    trans[4].tx_data[0] = 0x2C;                                 //memory write
-    trans[5].tx_buffer  = linedata;                             //finally send the line data
-    trans[5].length     = y_lines_num * LCD_SIZE_PX_X * 2 * 8;  //Data length, in bits
-    trans[5].flags      = 0;                                    //undo SPI_TRANS_USE_TXDATA flag
+    trans[0].tx_data[0] = 0x2A;                             //Column Address Set
+    trans[1].tx_data[0] = xpos >> 8;                        //Start Col High
+    trans[1].tx_data[1] = xpos & 0xff;                      //Start Col Low
+    trans[1].tx_data[2] = (xpos + width - 1) >> 8;          //End Col High
+    trans[1].tx_data[3] = (xpos + width - 1) & 0xff;        //End Col Low
+    trans[2].tx_data[0] = 0x2B;                             //Page address set
+    trans[3].tx_data[0] = ypos >> 8;                        //Start page high
+    trans[3].tx_data[1] = ypos & 0xff;                      //start page low
+    trans[3].tx_data[2] = (ypos + height - 1) >> 8;         //end page high
+    trans[3].tx_data[3] = (ypos + height - 1) & 0xff;       //end page low
+    trans[4].tx_data[0] = 0x2C;                             //memory write
+    trans[5].tx_buffer  = data;                             //finally send the pixel data
+    trans[5].length     = (uint32_t) width * height * 16;   //Data length, in bits
+    trans[5].flags      = 0;                                //undo SPI_TRANS_USE_TXDATA flag
 
     //Queue all transactions.
     for (x = 0; x < 6; x++) {
-        ret = spi_device_queue_trans(dev_lcdSpi, &trans[x], portMAX_DELAY);
+        ret = spi_device_queue_trans(panel->spi, &trans[x], portMAX_DELAY);
         assert(ret == ESP_OK);
     }
+    panel->trans_pending = true;
 
     //When we are here, the SPI driver is busy (in the background) getting the transactions sent. That happens
     //mostly using DMA, so the CPU doesn't have much to do here. We're not going to wait for the transaction to
@@ -101,25 +150,31 @@ void send_lines(spi_device_handle_t spi, int ypos, uint16_t y_lines_num, uint16_
 }
 
 
-void send_line_finish(spi_device_handle_t spi)
+void send_line_finish(lcd_panel_t *panel)
 {
     spi_transaction_t *rtrans;
     esp_err_t          ret;
+    if (!panel->trans_pending) return;
     //Wait for all 6 transactions to be done and get back the results.
     for (int x = 0; x < 6; x++) {
-        ret = spi_device_get_trans_result(dev_lcdSpi, &rtrans, portMAX_DELAY);
+        ret = spi_device_get_trans_result(panel->spi, &rtrans, portMAX_DELAY);
         assert(ret == ESP_OK);
         //We could inspect rtrans now if we received any info back. The LCD is treated as write-only, though.
     }
+    panel->trans_pending = false;
 }
 
-static inline uint16_t get_bgnd_pixel(uint16_t **pixels, int x, int y)
-{
-    //Image has an 8x8 pixel margin, so we can also resolve e.g. [-3, 243]
-    x += 8;
-    y += 8;
-    return pixels[y][x];
-}
+#ifndef FACE_TILE_ATLAS
+
+//Bands are calculated from the decoded images. A preview is decoded with a scale and gets pixel-multiplied.
+typedef struct {
+    uint16_t **pixels;
+    uint8_t    scale;
+} band_src_t;
+
+static inline bool band_src_valid(const band_src_t &src) { return src.pixels != NULL; }
+
+static inline uint8_t band_src_scale(const band_src_t &src) { return src.scale; }
 
 //Instead of calculating the offsets for each pixel we grab, we pre-calculate the valueswhenever a frame changes, then re-use
 //these as we go through all the pixels in the frame. This is much, much faster.
@@ -127,62 +182,324 @@ static inline uint16_t get_bgnd_pixel(uint16_t **pixels, int x, int y)
 //Calculate the pixel data for a set of lines (with implied line size of 320). Pixels go in dest, line is the Y-coordinate of the
 //first line to be calculated, linect is the amount of lines to calculate. Frame increases by one every time the entire image
 //is displayed; this is used to go to the next frame of animation.
-static void prepare_lines(uint16_t **src_image_in_pixels, uint16_t *dest, int line, int y_lines_num)
+static void IRAM_ATTR prepare_lines(const band_src_t &src, uint16_t *dest, int line, int y_lines_num)
 {
+    //Image has an 8x8 pixel margin, so we can also resolve e.g. [-3, 243]
     for (int y = line; y < line + y_lines_num; y++) {
-        for (int x = 0; x < LCD_SIZE_PX_X; x++) { *dest++ = get_bgnd_pixel(src_image_in_pixels, x, y); }
+        const uint16_t *row = src.pixels[(y + 8) >> src.scale];
+        for (int x = 0; x < LCD_SIZE_PX_X; x++) { *dest++ = row[(x + 8) >> src.scale]; }
     }
 }
 
-//Simple routine to generate some patterns and send them to the LCD. Don't expect anything too
-//impressive. Because the SPI driver handles transactions in the background, we can calculate the next line
-//while the previous one is being sent.
-void send_image(spi_device_handle_t spi, const uint8_t *img_jpg)
+//The last decoded image is kept, so it can be sent again (e.g. with another colour effect) without decoding
+static face_t     cached_jpg    = NULL;
+static uint16_t **cached_pixels = NULL;
+
+//Decode the faces of a frame with the scale. Every distinct image is decoded only once; a decoded frame takes a
+//good part of the heap. The cached image is used as is whatever the scale is.
+static void frame_decode(const face_t *faces, int num, band_src_t *srcs, uint8_t scale, send_abort_cb_t abort_cb)
 {
-    uint16_t *lines[2];
+    for (int p = 0; p < num; p++) {
+        srcs[p] = { NULL, scale };
+        for (int q = 0; q < p; q++) {
+            if (faces[q] == faces[p]) {
+                srcs[p] = srcs[q];
+                break;
+            }
+        }
+        if (srcs[p].pixels == NULL && faces[p] == cached_jpg) { srcs[p] = { cached_pixels, 0 }; }
+        if (srcs[p].pixels == NULL) { decode_image_scaled(&srcs[p].pixels, faces[p], scale, abort_cb); }
+    }
+}
 
-    //Allocate memory for the pixel buffers
-    for (int i = 0; i < 2; i++) {
-        lines[i] = static_cast<uint16_t *>(
-                heap_caps_malloc(LCD_SIZE_PX_X * PARALLEL_LINES * sizeof(uint16_t), MALLOC_CAP_DMA));
-        assert(lines[i] != NULL);
+#if PROGRESSIVE_PREVIEW_SCALE > 0
+static bool frame_cached(const face_t *faces, int num)
+{
+    for (int p = 0; p < num; p++) {
+        if (faces[p] != cached_jpg) return false;
     }
+    return true;
+}
 
-    uint16_t **image_in_pixels;
-    decode_image(&image_in_pixels, img_jpg);
+//Free the preview images, the cached one stays
+static void frame_release_preview(int num, band_src_t *srcs)
+{
+    for (int p = 0; p < num; p++) {
+        bool freed = (srcs[p].pixels == cached_pixels);
+        for (int q = 0; q < p; q++) { freed |= (srcs[q].pixels == srcs[p].pixels); }
+        if (!freed) { decode_image_free(srcs[p].pixels, srcs[p].scale); }
+    }
+}
+#endif
 
-    //Indexes of the line currently being sent to the LCD and the line we're calculating.
-    int sending_line = -1;
-    int calc_line    = 0;
+static void frame_acquire(const face_t *faces, int num, band_src_t *srcs, send_abort_cb_t abort_cb)
+{
+    //Drop the cached image if this frame does not need it, so there is room to decode the new ones
+    bool cache_used = false;
+    for (int p = 0; p < num; p++) { cache_used |= (faces[p] == cached_jpg); }
+    if (!cache_used) {
+        decode_image_free(cached_pixels, 0);
+        cached_pixels = NULL;
+        cached_jpg    = NULL;
+    }
+
+    frame_decode(faces, num, srcs, 0, abort_cb);
+}
 
+//The image of the first panel stays decoded as the cache, everything else is freed
+static void frame_release(const face_t *faces, int num, band_src_t *srcs)
+{
+    uint16_t **decoded[LCD_PANELS_NUM + 1];
+    int        decoded_num = 0;
+    for (int p = 0; p < num; p++) { decoded[decoded_num++] = srcs[p].pixels; }
+    decoded[decoded_num++] = cached_pixels;
+
+    cached_pixels = srcs[0].pixels;
+    cached_jpg    = (cached_pixels != NULL) ? faces[0] : NULL;
+    for (int i = 0; i < decoded_num; i++) {
+        bool freed = (decoded[i] == cached_pixels);
+        for (int j = 0; j < i; j++) { freed |= (decoded[j] == decoded[i]); }
+        if (!freed) { decode_image_free(decoded[i], 0); }
+    }
+}
+
+static inline void prepare_band(const band_src_t &src, uint16_t *dest, int line, int y_lines_num)
+{
+    prepare_lines(src, dest, line, y_lines_num);
+}
+
+//Get the rectangle of the face as rect.w x rect.h pixels. A cached face is copied, there is nothing to decode.
+static uint16_t *rect_acquire(face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb)
+{
+    uint16_t *pixels = NULL;
+    if (face == cached_jpg && rect.x + rect.w <= IMAGE_W && rect.y + rect.h <= IMAGE_H) {
+        pixels = static_cast<uint16_t *>(heap_caps_malloc(rect.w * rect.h * sizeof(uint16_t), MALLOC_CAP_DMA));
+        for (int y = 0; pixels != NULL && y < rect.h; y++) {
+            memcpy(&pixels[y * rect.w], &cached_pixels[rect.y + y][rect.x], rect.w * sizeof(uint16_t));
+        }
+    } else {
+        decode_image_rect(&pixels, face, &rect, abort_cb);
+    }
+    return pixels;
+}
+
+#else
+
+//Bands are copied from the tile atlas, there is nothing to decode
+typedef face_t band_src_t;
+
+static inline bool band_src_valid(const band_src_t &src) { return src != NULL; }
+
+static inline uint8_t band_src_scale(const band_src_t &src) { return 0; }
+
+static void frame_acquire(const face_t *faces, int num, band_src_t *srcs, send_abort_cb_t abort_cb)
+{
+    for (int p = 0; p < num; p++) { srcs[p] = faces[p]; }
+}
+
+static void frame_release(const face_t *faces, int num, band_src_t *srcs) {}
+
+static inline void prepare_band(const band_src_t &src, uint16_t *dest, int line, int y_lines_num)
+{
+    tiles_prepare_lines(src, dest, line, y_lines_num);
+}
+
+//Get the rectangle of the face as rect.w x rect.h pixels: the lines of the rectangle are copied from the atlas one
+//by one and cut.
+static uint16_t *rect_acquire(face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb)
+{
+    uint16_t *line   = static_cast<uint16_t *>(malloc(LCD_SIZE_PX_X * sizeof(uint16_t)));
+    uint16_t *pixels = static_cast<uint16_t *>(heap_caps_malloc(rect.w * rect.h * sizeof(uint16_t), MALLOC_CAP_DMA));
+    if (line == NULL || pixels == NULL) {
+        free(line);
+        free(pixels);
+        return NULL;
+    }
+    //The atlas covers the screen only; the margin of the rectangle is left black
+    memset(pixels, 0, rect.w * rect.h * sizeof(uint16_t));
+    for (int y = 0; y < rect.h; y++) {
+        int line_y = rect.y + y - 8;
+        if (line_y < 0 || line_y >= LCD_SIZE_PX_Y) continue;
+        tiles_prepare_lines(face, line, line_y, 1);
+        for (int x = 0; x < rect.w; x++) {
+            int line_x = rect.x + x - 8;
+            if (line_x >= 0 && line_x < LCD_SIZE_PX_X) { pixels[y * rect.w + x] = line[line_x]; }
+        }
+    }
+    free(line);
+    return pixels;
+}
+
+#endif
+
+static void band_done(const band_src_t &src, uint32_t us)
+{
+    uint32_t &us_min = band_us_min[color_lut_selected()][band_src_scale(src) & 3];
+    if (us_min == 0 || us < us_min) { us_min = us; }
+    frame_stats.bands++;
+    if (us > frame_stats.band_us_max) { frame_stats.band_us_max = us; }
+    if (us > us_min * SEND_STALL_FACTOR) { frame_stats.band_stalls++; }
+}
+
+//Send a frame band by band. Returns false if aborted.
+static bool send_bands(lcd_panel_t *const *panels, const band_src_t *srcs, int panels_num,
+                       uint16_t *(*lines)[2], send_abort_cb_t abort_cb)
+{
+    int calc_line[LCD_PANELS_NUM] = {};
 
     for (int y_cur = 0; y_cur < LCD_SIZE_PX_Y; y_cur += PARALLEL_LINES) {
-        //Calculate a line.
-        prepare_lines(image_in_pixels, lines[calc_line], y_cur, PARALLEL_LINES);
+        //Band boundary: drop the rest of the frame if it is obsolete already
+        if (abort_cb != nullptr && abort_cb()) {
+            for (int p = 0; p < panels_num; p++) { send_line_finish(panels[p]); }
+            return false;
+        }
+        for (int p = 0; p < panels_num; p++) {
+            if (!band_src_valid(srcs[p])) continue;  //Decoding failed, leave the panel as it is
+
+            //Calculate a line. The other panels' bands keep the bus busy meanwhile.
+            int64_t start = esp_timer_get_time();
+            prepare_band(srcs[p], lines[p][calc_line[p]], y_cur, PARALLEL_LINES);
+            color_lut_apply(lines[p][calc_line[p]], LCD_SIZE_PX_X * PARALLEL_LINES);
+            band_done(srcs[p], (uint32_t) (esp_timer_get_time() - start));
+
+            //Finish up the sending process of the previous line of this panel, if any
+            send_line_finish(panels[p]);
+
+            //Send the line we currently calculated.
+            send_lines(panels[p], y_cur, PARALLEL_LINES, lines[p][calc_line[p]]);
+
+            //The line set is queued up for sending now; the actual sending happens in the
+            //background. We can go on to calculate the next line set as long as we do not
+            //touch the buffer being sent; the SPI sending process is still reading from that.
+            calc_line[p] = (calc_line[p] == 1) ? 0 : 1;
+        }
+    }
+    for (int p = 0; p < panels_num; p++) { send_line_finish(panels[p]); }  // the last lines
+    return true;
+}
+
+bool send_images(lcd_panel_t *const *panels, const face_t *faces, int panels_num, send_abort_cb_t abort_cb)
+{
+    bool       done = true;
+    uint16_t  *lines[LCD_PANELS_NUM][2];
+    band_src_t srcs[LCD_PANELS_NUM];
 
-        //Finish up the sending process of the previous line, if any
-        if (sending_line != -1) send_line_finish(dev_lcdSpi);
+    assert(panels_num > 0 && panels_num <= LCD_PANELS_NUM);
 
-        //Swap sending_line and calc_line
-        sending_line = calc_line;
-        calc_line    = (calc_line == 1) ? 0 : 1;
+    int64_t frame_start = esp_timer_get_time();
+    int64_t decode_us   = 0;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    decode_image_stats_reset();
 
-        //Send the line we currently calculated.
-        send_lines(dev_lcdSpi, y_cur, PARALLEL_LINES, lines[sending_line]);
+    //Allocate memory for the pixel buffers
+    for (int p = 0; p < panels_num; p++) {
+        for (int i = 0; i < 2; i++) {
+            lines[p][i] = static_cast<uint16_t *>(
+                    heap_caps_malloc(LCD_SIZE_PX_X * PARALLEL_LINES * sizeof(uint16_t), MALLOC_CAP_DMA));
+            assert(lines[p][i] != NULL);
+        }
+    }
 
-        //The line set is queued up for sending now; the actual sending happens in the
-        //background. We can go on to calculate the next line set as long as we do not
-        //touch line[sending_line]; the SPI sending process is still reading from that.
+#if !defined(FACE_TILE_ATLAS) && PROGRESSIVE_PREVIEW_SCALE > 0
+    //A face that is not decoded yet is shown as a cheap low-res preview first, then refined
+    if (!frame_cached(faces, panels_num)) {
+        int64_t start = esp_timer_get_time();
+        frame_decode(faces, panels_num, srcs, PROGRESSIVE_PREVIEW_SCALE, abort_cb);
+        decode_us += esp_timer_get_time() - start;
+        done = send_bands(panels, srcs, panels_num, lines, abort_cb);
+        frame_release_preview(panels_num, srcs);
     }
-    send_line_finish(dev_lcdSpi);  // the last line
+#endif
 
+    if (done) {
+        int64_t start = esp_timer_get_time();
+        frame_acquire(faces, panels_num, srcs, abort_cb);
+        decode_us += esp_timer_get_time() - start;
+        done = send_bands(panels, srcs, panels_num, lines, abort_cb);
+        frame_release(faces, panels_num, srcs);
+    }
 
-    // Clean up
-    if (image_in_pixels != NULL) {
-        for (int i = 0; i < IMAGE_H; i++) { free((image_in_pixels)[i]); }
-        free(image_in_pixels);
+    for (int p = 0; p < panels_num; p++) {
+        for (int i = 0; i < 2; i++) { free(lines[p][i]); }
     }
-    for (int i = 0; i < 2; i++) { free(lines[i]); }
+
+    frame_stats.frame_us  = (uint32_t) (esp_timer_get_time() - frame_start);
+    frame_stats.decode_us = (uint32_t) decode_us;
+    decode_image_get_stats(&frame_stats.decode);
+    ESP_LOGD(TAG, "Frame: %u us (decode %u us), %u/%u bands stalled (max %u us), %u/%u blocks stalled (max %u cycles)",
+             frame_stats.frame_us, frame_stats.decode_us, frame_stats.band_stalls, frame_stats.bands,
+             frame_stats.band_us_max, frame_stats.decode.mcu_stalls, frame_stats.decode.mcus,
+             frame_stats.decode.mcu_cycles_max);
+    return done;
 }
 
-spi_device_handle_t dev_lcdSpi = nullptr;
+void send_get_frame_stats(send_frame_stats_t *out) { *out = frame_stats; }
+
+//Send a rectangle of a face to the panels as windows
+static bool send_rect(lcd_panel_t *const *panels, int panels_num, face_t face, const decode_rect_t &rect,
+                      send_abort_cb_t abort_cb)
+{
+    //Visible part of the rectangle, in screen coordinates. The image has an 8x8 pixel margin.
+    int x0 = rect.x - 8 > 0 ? rect.x - 8 : 0;
+    int y0 = rect.y - 8 > 0 ? rect.y - 8 : 0;
+    int x1 = rect.x + rect.w - 8 < LCD_SIZE_PX_X ? rect.x + rect.w - 8 : LCD_SIZE_PX_X;
+    int y1 = rect.y + rect.h - 8 < LCD_SIZE_PX_Y ? rect.y + rect.h - 8 : LCD_SIZE_PX_Y;
+    if (x1 <= x0 || y1 <= y0) return true;
+
+    uint16_t *pixels = rect_acquire(face, rect, abort_cb);
+    if (pixels == NULL) return false;
+
+    //Cut off the margin: the visible rows are packed in place, rows only move towards the start of the buffer
+    int w = x1 - x0;
+    for (int y = y0; y < y1; y++) {
+        memmove(&pixels[(y - y0) * w], &pixels[(y + 8 - rect.y) * rect.w + (x0 + 8 - rect.x)], w * sizeof(uint16_t));
+    }
+    color_lut_apply(pixels, w * (y1 - y0));
+
+    //A window must fit into a band, so the rectangle goes in strips. The buffer is not touched anymore, so a strip
+    //of every panel can be queued at once.
+    bool done    = true;
+    int  strip_h = (LCD_SIZE_PX_X * PARALLEL_LINES) / w;
+    for (int y = y0; y < y1; y += strip_h) {
+        if (abort_cb != nullptr && abort_cb()) {
+            done = false;
+            break;
+        }
+        int h = (y1 - y < strip_h) ? y1 - y : strip_h;
+        for (int p = 0; p < panels_num; p++) {
+            send_line_finish(panels[p]);
+            send_window(panels[p], x0, y, w, h, &pixels[(y - y0) * w]);
+        }
+    }
+    for (int p = 0; p < panels_num; p++) { send_line_finish(panels[p]); }
+    free(pixels);
+    return done;
+}
+
+bool send_image_rect(lcd_panel_t *panel, face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb)
+{
+    return send_rect(&panel, 1, face, rect, abort_cb);
+}
+
+bool send_image_rect_all(face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb)
+{
+    lcd_panel_t *panels[LCD_PANELS_NUM];
+    for (int i = 0; i < LCD_PANELS_NUM; i++) { panels[i] = &lcd_panels[i]; }
+    return send_rect(panels, LCD_PANELS_NUM, face, rect, abort_cb);
+}
+
+bool send_image(lcd_panel_t *panel, face_t face, send_abort_cb_t abort_cb)
+{
+    return send_images(&panel, &face, 1, abort_cb);
+}
+
+bool send_image_all(face_t face, send_abort_cb_t abort_cb)
+{
+    lcd_panel_t *panels[LCD_PANELS_NUM];
+    face_t       faces[LCD_PANELS_NUM];
+    for (int i = 0; i < LCD_PANELS_NUM; i++) {
+        panels[i] = &lcd_panels[i];
+        faces[i]  = face;
+    }
+    return send_images(panels, faces, LCD_PANELS_NUM, abort_cb);
+}
@@ -13,8 +13,62 @@
 #pragma once
 
 #include <stdint.h>
+#include "driver/gpio.h"
+#include "decode_image.h"
 #include "driver/spi_master.h"
+#include "faces.h"
+#include "pinout.hpp"
 
+//A face that is not decoded yet is first shown as a preview decoded at 1/2^PROGRESSIVE_PREVIEW_SCALE of its
+//resolution (1..3), then refined to the full resolution. 0 disables the preview. The preview is one more frame
+//over SPI, so it pays off only with a slow decode and a fast bus.
+#ifndef PROGRESSIVE_PREVIEW_SCALE
+#ifdef CONFIG_LCD_PROGRESSIVE_PREVIEW_SCALE
+#define PROGRESSIVE_PREVIEW_SCALE CONFIG_LCD_PROGRESSIVE_PREVIEW_SCALE
+#else
+#define PROGRESSIVE_PREVIEW_SCALE 0
+#endif
+#endif
+
+#ifdef FACE_TILE_ATLAS
+#include "face_atlas.h"
+#endif
+
+//Level of a D/C line. Transactions point their `user` field to one of these so the pre-transfer callback knows
+//which panel's D/C pin to drive.
+typedef struct {
+    gpio_num_t pin;
+    int        level;
+} lcd_dc_t;
+
+/*
+ A single LCD panel on the shared SPI bus. Every panel has its own CS (handled by the SPI driver), its own D/C line
+ and its own set of band transactions, so bands of different panels can be queued at the same time.
+*/
+typedef struct {
+    const char         *name;
+    gpio_num_t          pin_cs;
+    gpio_num_t          pin_dc;
+    spi_device_handle_t spi;
+    lcd_dc_t            dc_cmd;
+    lcd_dc_t            dc_data;
+    spi_transaction_t   trans[6];  //Must outlive send_lines(): the SPI driver reads them in the background
+    bool                trans_pending;
+} lcd_panel_t;
+
+extern lcd_panel_t lcd_panels[LCD_PANELS_NUM];
+
+#ifdef FACE_TILE_ATLAS
+//A face is a map of the tile atlas (see tools/make_tile_atlas.py)
+typedef const uint16_t *face_t;
+#define FACE(name) name##_MAP
+#else
+//A face is an embedded jpeg
+typedef const uint8_t *face_t;
+#define FACE(name) name##_JPG
+#endif
+
+//Initialize the bus and attach all the panels to it
 void init_spi();
 
 /* To send a set of lines we have to send a command, 2 data bytes, another command, 2 more data bytes and another command
@@ -24,13 +78,50 @@ void init_spi();
  * sent faster (compared to calling spi_device_transmit several times), and at
  * the mean while the lines for next transactions can get calculated.
  */
-void send_lines(spi_device_handle_t spi, int ypos, uint16_t y_lines_num, uint16_t *linedata);
+void send_lines(lcd_panel_t *panel, int ypos, uint16_t y_lines_num, uint16_t *linedata);
+
+//Same as send_lines, but only for the width x height window at (xpos, ypos). The window must fit into a band.
+void send_window(lcd_panel_t *panel, int xpos, int ypos, uint16_t width, uint16_t height, uint16_t *data);
+
+//Wait for the band queued by send_lines/send_window to be sent. Does nothing if the panel has no band in flight.
+void send_line_finish(lcd_panel_t *panel);
+
+//Returns true if the frame in progress should be dropped, e.g. because a newer one is pending.
+typedef bool (*send_abort_cb_t)(void);
+
+//The functions sending frames share the decoded-frame cache, call them from the display task only (see set_lcd()).
+
+//Send the faces to the panels (faces[i] goes to panels[i]). Bands of different panels are interleaved: while one
+//panel's band is being sent over DMA, the next panel's band gets calculated and queued, so the shared bus does not
+//idle between panels. Panels showing the same image share one decoded copy.
+//abort_cb (optional) is polled while decoding and at every band boundary; once it returns true, the frame is dropped
+//and the function returns false as soon as the bands in flight are sent. The caller has to draw a full frame after
+//that, the panels show the new bands on top and the old image below.
+bool send_images(lcd_panel_t *const *panels, const face_t *faces, int panels_num, send_abort_cb_t abort_cb = nullptr);
+
+//Send one face to one panel.
+bool send_image(lcd_panel_t *panel, face_t face, send_abort_cb_t abort_cb = nullptr);
+
+//Send the same face to all the panels.
+bool send_image_all(face_t face, send_abort_cb_t abort_cb = nullptr);
+
+//Redraw only a rectangle of the face (in image pixels, i.e. with the 8px margin; MCU-aligned, see decode_image_rect).
+//Only that part of the jpeg is decoded. The rest of the screen must already show the same face, e.g. when only the
+//eyes differ. The rectangle is clipped to the screen. Returns false if aborted or the rectangle can't be decoded.
+bool send_image_rect(lcd_panel_t *panel, face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb = nullptr);
 
-void send_line_finish(spi_device_handle_t spi);
+//Same for all the panels, the rectangle is decoded once
+bool send_image_rect_all(face_t face, const decode_rect_t &rect, send_abort_cb_t abort_cb = nullptr);
 
-//Simple routine to generate some patterns and send them to the LCD. Don't expect anything too
-//impressive. Because the SPI driver handles transactions in the background, we can calculate the next line
-//while the previous one is being sent.
-void send_image(spi_device_handle_t spi, const uint8_t *img_jpg);
+//Timing of the last frame sent by send_images. Stalls show how much the frame waited for memory, e.g. because
+//other tasks evicted the flash cache.
+typedef struct {
+    uint32_t       frame_us;     //The whole frame, decoding included
+    uint32_t       decode_us;    //Decoding only
+    uint16_t       bands;        //Bands calculated
+    uint16_t       band_stalls;  //Bands that took SEND_STALL_FACTOR times longer than the fastest one of their kind
+    uint32_t       band_us_max;  //The slowest band
+    decode_stats_t decode;       //Blocks decoded for the frame
+} send_frame_stats_t;
 
-extern spi_device_handle_t dev_lcdSpi;
+void send_get_frame_stats(send_frame_stats_t *out);
@@ -0,0 +1,69 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#include "esp_attr.h"
+#include "lcd.hpp"
+#include "tiles.hpp"
+
+static_assert(FACE_TILES_X * FACE_TILE_SIZE == LCD_SIZE_PX_X, "The atlas does not match the LCD width");
+static_assert(FACE_TILES_Y * FACE_TILE_SIZE == LCD_SIZE_PX_Y, "The atlas does not match the LCD height");
+
+//Decode row `row` of a tile into `out`
+FORCE_INLINE_ATTR void tile_row(uint32_t tile, int row, uint16_t *out)
+{
+    const uint8_t *src = &face_tile_data[tile & ~FACE_TILE_RLE];
+#if FACE_TILE_BPP == 4
+    if (tile & FACE_TILE_RLE) {
+        //A run may go on from the row above: skip the pixels of the rows above
+        int skip = row * FACE_TILE_SIZE;
+        int run  = (*src >> 4) + 1;
+        while (skip >= run) {
+            skip -= run;
+            run = (*++src >> 4) + 1;
+        }
+        run -= skip;
+        for (int x = 0; x < FACE_TILE_SIZE; x++, run--) {
+            if (run == 0) { run = (*++src >> 4) + 1; }
+            out[x] = face_palette[*src & 0x0F];
+        }
+        return;
+    }
+    src += row * FACE_TILE_SIZE / 2;
+    for (int x = 0; x < FACE_TILE_SIZE; x += 2, src++) {
+        out[x]     = face_palette[*src >> 4];
+        out[x + 1] = face_palette[*src & 0x0F];
+    }
+#else
+    src += row * FACE_TILE_SIZE;
+    for (int x = 0; x < FACE_TILE_SIZE; x++) { out[x] = face_palette[src[x]]; }
+#endif
+}
+
+void IRAM_ATTR tiles_prepare_lines(const uint16_t *face_map, uint16_t *dest, int line, int y_lines_num)
+{
+    uint16_t row[FACE_TILE_SIZE];
+
+    for (int y = line; y < line + y_lines_num; y++) {
+        const uint16_t *map_row = &face_map[(y / FACE_TILE_SIZE) * FACE_TILES_X];
+
+        for (int tx = 0; tx < FACE_TILES_X; tx++) {
+            uint16_t entry = map_row[tx];
+            tile_row(face_tiles[entry & ~FACE_TILE_MIRROR], y % FACE_TILE_SIZE, row);
+            if (entry & FACE_TILE_MIRROR) {
+                //Mirrored tile, copy the row backwards
+                for (int x = FACE_TILE_SIZE - 1; x >= 0; x--) { *dest++ = row[x]; }
+            } else {
+                for (int x = 0; x < FACE_TILE_SIZE; x++) { *dest++ = row[x]; }
+            }
+        }
+    }
+}
@@ -0,0 +1,20 @@
+// *************************************************************************
+//
+// Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+//
+// This file is licensed under the terms of the MIT license.
+// For a copy, see: https://opensource.org/licenses/MIT
+//
+// site:    https://agramakov.me
+// e-mail:  mail@agramakov.me
+//
+// *************************************************************************
+
+#pragma once
+
+#include <stdint.h>
+#include "face_atlas.h"
+
+//Fill a band of lines (with implied line size of 320) from the tiles of the face map. Pixels go in dest, line is
+//the Y-coordinate of the first line, y_lines_num is the amount of lines.
+void tiles_prepare_lines(const uint16_t *face_map, uint16_t *dest, int line, int y_lines_num);
@@ -22,6 +22,7 @@
 
 
 #include "communication/can.hpp"
+#include "communication/commands.h"
 #include "display/lcd.hpp"
 #include "faces.h"
 
@@ -32,18 +33,18 @@ extern "C" void app_main()
     start_can();
     start_display();
 
-    //Go do nice stuff.
-    send_image(dev_lcdSpi, BLINK_JPG);
+    //Go do nice stuff. The display task draws, so a command from CAN meanwhile just takes over.
+    set_lcd(CMD_BLINK);
     vTaskDelay(500 / portTICK_RATE_MS);
-    send_image(dev_lcdSpi, HAPPY_JPG);
+    set_lcd(CMD_HAPPY);
     vTaskDelay(500 / portTICK_RATE_MS);
-    send_image(dev_lcdSpi, SAD_JPG);
+    set_lcd(CMD_SAD);
     vTaskDelay(500 / portTICK_RATE_MS);
-    send_image(dev_lcdSpi, ANGRY_JPG);
+    set_lcd(CMD_ANGRY);
     vTaskDelay(500 / portTICK_RATE_MS);
-    send_image(dev_lcdSpi, BLINK_JPG);
+    set_lcd(CMD_BLINK);
     vTaskDelay(300 / portTICK_RATE_MS);
-    send_image(dev_lcdSpi, CALM_JPG);
+    set_lcd(CMD_CALM);
 
     while (1) { vTaskDelay(1); }
 }
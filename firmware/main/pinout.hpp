@@ -54,3 +54,12 @@
 #define PIN_NUM_BCKL static_cast<gpio_num_t>(5)
 
 #endif
+
+/* Panels. The right eye panel (CS_R/DC_R) shares MOSI/MISO/CLK/RST/BCKL with the left one, see Kconfig.projbuild */
+#ifdef CONFIG_LCD_DUAL_PANEL
+#define LCD_PANELS_NUM 2
+#define PIN_NUM_CS_R static_cast<gpio_num_t>(CONFIG_LCD_PIN_CS_R)
+#define PIN_NUM_DC_R static_cast<gpio_num_t>(CONFIG_LCD_PIN_DC_R)
+#else
+#define LCD_PANELS_NUM 1
+#endif
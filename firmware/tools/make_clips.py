@@ -0,0 +1,191 @@
+# *************************************************************************
+#
+# Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+#
+# This file is licensed under the terms of the MIT license.
+# For a copy, see: https://opensource.org/licenses/MIT
+#
+# site:    https://agramakov.me
+# e-mail:  mail@agramakov.me
+#
+# *************************************************************************
+
+"""Pack frame sequences into delta-compressed animation clips.
+
+Every clip is a directory of frames (sorted by file name) with the same size as the faces. The first
+frame is stored as a full-screen keyframe, every next one as the rectangles that changed since the
+previous frame. Rectangle pixels are RLE coded RGB565, byte-swapped for the LCD.
+
+Clip layout, all 16-bit words:
+    magic (0xC11B), fps, frames number,
+    per frame: rectangles number,
+        per rectangle: x, y, w, h, RLE words (low, high), RLE words
+RLE word: bit 15 set - the next word is repeated (bits 0..14) + 1 times,
+          otherwise (bits 0..14) + 1 literal pixels follow.
+
+Output: face_clips.h and face_clips.c with the face_clips table, in the order of the arguments.
+An argument may set the frame rate after a colon: `clips/talk:25`.
+"""
+
+import argparse
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from make_tile_atlas import LCD_H, LCD_W, load_rgb565  # noqa: E402
+
+CLIP_MAGIC = 0xC11B
+BLOCK = 16  # changes are looked for in blocks of this size
+MAX_RUN = 0x8000
+DEFAULT_FPS = 20
+
+
+def rle(pixels):
+    out = []
+    i = 0
+    n = len(pixels)
+    literal = []
+
+    def flush():
+        while literal:
+            chunk = literal[:MAX_RUN]
+            del literal[:MAX_RUN]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+
+    while i < n:
+        run = 1
+        while i + run < n and run < MAX_RUN and pixels[i + run] == pixels[i]:
+            run += 1
+        if run >= 3:
+            flush()
+            out.extend([0x8000 | (run - 1), pixels[i]])
+            i += run
+        else:
+            literal.extend(pixels[i:i + run])
+            i += run
+    flush()
+    return out
+
+
+def changed_rects(prev, cur):
+    """Rectangles covering the changed blocks: runs of blocks in a row, merged with equal runs below."""
+    bx_num = LCD_W // BLOCK
+    by_num = LCD_H // BLOCK
+
+    def block_changed(bx, by):
+        for y in range(by * BLOCK, (by + 1) * BLOCK):
+            row = y * LCD_W
+            if prev[row + bx * BLOCK:row + (bx + 1) * BLOCK] != cur[row + bx * BLOCK:row + (bx + 1) * BLOCK]:
+                return True
+        return False
+
+    rects = []  # [x0, x1, y0, y1] in blocks, y1 exclusive
+    open_rects = {}
+    for by in range(by_num):
+        runs = []
+        bx = 0
+        while bx < bx_num:
+            if block_changed(bx, by):
+                start = bx
+                while bx < bx_num and block_changed(bx, by):
+                    bx += 1
+                runs.append((start, bx))
+            else:
+                bx += 1
+        next_open = {}
+        for run in runs:
+            r = open_rects.pop(run, None)
+            if r is None:
+                r = [run[0], run[1], by, by + 1]
+                rects.append(r)
+            else:
+                r[3] = by + 1
+            next_open[run] = r
+        open_rects = next_open
+    return [(x0 * BLOCK, y0 * BLOCK, (x1 - x0) * BLOCK, (y1 - y0) * BLOCK) for x0, x1, y0, y1 in rects]
+
+
+def crop(pixels, x, y, w, h):
+    out = []
+    for row in range(y, y + h):
+        out.extend(pixels[row * LCD_W + x:row * LCD_W + x + w])
+    return out
+
+
+def encode_rect(words, pixels, rect):
+    data = rle(crop(pixels, *rect))
+    words.extend(rect)
+    words.extend([len(data) & 0xFFFF, len(data) >> 16])
+    words.extend(data)
+
+
+def build_clip(frames, fps):
+    """frames: list of pixel lists. Returns the clip as a list of 16-bit words."""
+    words = [CLIP_MAGIC, fps, len(frames)]
+    prev = None
+    for cur in frames:
+        rects = [(0, 0, LCD_W, LCD_H)] if prev is None else changed_rects(prev, cur)
+        words.append(len(rects))
+        for rect in rects:
+            encode_rect(words, cur, rect)
+        prev = cur
+    return words
+
+
+def clip_name(path):
+    stem = os.path.basename(os.path.normpath(path))
+    return "".join(c if c.isalnum() else "_" for c in stem).upper() + "_CLIP"
+
+
+def write(out_dir, clips):
+    with open(os.path.join(out_dir, "face_clips.h"), "w") as f:
+        f.write("// Generated by make_clips.py, do not edit\n\n")
+        f.write("#pragma once\n\n#include <stdint.h>\n\n")
+        f.write("#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n")
+        f.write("#define FACE_CLIP_MAGIC 0x%04X\n" % CLIP_MAGIC)
+        f.write("#define FACE_CLIPS_NUM %d\n\n" % len(clips))
+        for name, _ in clips:
+            f.write("extern const uint16_t %s[];\n" % name)
+        f.write("extern const uint16_t *const face_clips[];\n")
+        f.write("\n#ifdef __cplusplus\n}\n#endif\n")
+
+    with open(os.path.join(out_dir, "face_clips.c"), "w") as f:
+        f.write("// Generated by make_clips.py, do not edit\n\n")
+        f.write("#include <stddef.h>\n#include \"face_clips.h\"\n")
+        for name, words in clips:
+            f.write("\nconst uint16_t %s[] = {\n" % name)
+            for i in range(0, len(words), 16):
+                f.write("    " + ",".join("0x%04x" % w for w in words[i:i + 16]) + ",\n")
+            f.write("};\n")
+        f.write("\nconst uint16_t *const face_clips[] = {\n")
+        for name, _ in clips:
+            f.write("    %s,\n" % name)
+        if not clips:
+            f.write("    NULL,\n")
+        f.write("};\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--out-dir", required=True)
+    parser.add_argument("--margin", type=int, default=8, help="margin of the frames around the visible part")
+    parser.add_argument("clips", nargs="*", help="directories with frames, optionally followed by :fps")
+    args = parser.parse_args()
+
+    clips = []
+    for arg in args.clips:
+        path, _, fps = arg.partition(":")
+        fps = int(fps) if fps else DEFAULT_FPS
+        files = sorted(os.listdir(path))
+        frames = [load_rgb565(os.path.join(path, f), args.margin) for f in files]
+        if not frames:
+            sys.exit("make_clips.py: no frames in %s" % path)
+        words = build_clip(frames, fps)
+        clips.append((clip_name(path), words))
+        print("Clip %s: %d frames, %d bytes" % (clip_name(path), len(frames), len(words) * 2))
+    write(args.out_dir, clips)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,239 @@
+# *************************************************************************
+#
+# Copyright (c) 2022 Andrei Gramakov. All rights reserved.
+#
+# This file is licensed under the terms of the MIT license.
+# For a copy, see: https://opensource.org/licenses/MIT
+#
+# site:    https://agramakov.me
+# e-mail:  mail@agramakov.me
+#
+# *************************************************************************
+
+"""Split the face images into tiles, deduplicate them across all the faces and emit a tile atlas.
+
+The visible 320x240 part of every face is quantized to a palette shared by all the faces (16 colours by
+default, 4 bits per pixel; or 256, 8 bits per pixel), then cut into square tiles. Quantizing first also
+removes the JPEG noise, so tiles that look the same are the same. Identical tiles, and tiles that are a
+horizontal mirror of an already stored one, are stored once. With 16 colours a tile is run-length encoded
+when that is smaller than packing it. Every face becomes a map of tile indexes (bit 15 set - the tile is
+mirrored). The palette is RGB565, byte-swapped for the LCD.
+
+Output: face_atlas.h and face_atlas.c. The map of `calm.jpg` is named CALM_MAP. The atlas size is reported
+against the size of the JPEG files it replaces.
+
+Requires Pillow to read the JPEG files.
+"""
+
+import argparse
+import os
+import sys
+
+LCD_W = 320
+LCD_H = 240
+MIRROR_FLAG = 0x8000
+RLE_FLAG = 0x80000000
+
+
+def open_visible(path, margin):
+    try:
+        from PIL import Image
+    except ImportError:
+        sys.exit("make_tile_atlas.py: Pillow is required to build the tile atlas (pip install pillow)")
+    img = Image.open(path).convert("RGB")
+    return img.crop((margin, margin, margin + LCD_W, margin + LCD_H))
+
+
+def rgb565(r, g, b):
+    v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+    return ((v >> 8) | (v << 8)) & 0xFFFF  # the LCD wants big-endian
+
+
+def load_rgb565(path, margin):
+    return [rgb565(r, g, b) for r, g, b in open_visible(path, margin).getdata()]
+
+
+def load_quantized(paths, margin, colors):
+    """Quantize the faces to one shared palette. Returns the palette (RGB565) and the index pixels of every face."""
+    from PIL import Image
+    faces = [open_visible(p, margin) for p in paths]
+    sheet = Image.new("RGB", (LCD_W, LCD_H * len(faces)))
+    for i, img in enumerate(faces):
+        sheet.paste(img, (0, i * LCD_H))
+    sheet = sheet.quantize(colors=colors, dither=Image.Dither.NONE)
+    rgb = sheet.getpalette()[:colors * 3]
+    rgb += [0] * (colors * 3 - len(rgb))
+    palette = [rgb565(*rgb[i * 3:i * 3 + 3]) for i in range(colors)]
+    indexes = list(sheet.tobytes())
+    size = LCD_W * LCD_H
+    return palette, [indexes[i * size:(i + 1) * size] for i in range(len(faces))]
+
+
+def split_tiles(pixels, tile):
+    tiles = []
+    for ty in range(LCD_H // tile):
+        for tx in range(LCD_W // tile):
+            rows = []
+            for y in range(tile):
+                start = (ty * tile + y) * LCD_W + tx * tile
+                rows.append(tuple(pixels[start:start + tile]))
+            tiles.append(tuple(rows))
+    return tiles
+
+
+def mirror(t):
+    return tuple(tuple(reversed(row)) for row in t)
+
+
+class Atlas:
+    def __init__(self):
+        self.tiles = []
+        self.index = {}
+
+    def add(self, t):
+        if t in self.index:
+            return self.index[t]
+        m = mirror(t)
+        if m in self.index:
+            return self.index[m] | MIRROR_FLAG
+        idx = len(self.tiles)
+        if idx >= MIRROR_FLAG:
+            sys.exit("make_tile_atlas.py: too many unique tiles")
+        self.tiles.append(t)
+        self.index[t] = idx
+        return idx
+
+
+def map_name(path):
+    stem = os.path.splitext(os.path.basename(path))[0]
+    return "".join(c if c.isalnum() else "_" for c in stem).upper() + "_MAP"
+
+
+def build(faces, tile):
+    """faces: list of (name, pixels). Returns the atlas and a list of (name, map)."""
+    atlas = Atlas()
+    maps = []
+    for name, pixels in faces:
+        maps.append((name, [atlas.add(t) for t in split_tiles(pixels, tile)]))
+    return atlas, maps
+
+
+def pack(t, bpp):
+    """Pixels of a tile row by row, two per byte (the first one in the high nibble) with 4 bpp."""
+    flat = [p for row in t for p in row]
+    if bpp == 8:
+        return flat
+    return [(flat[i] << 4) | flat[i + 1] for i in range(0, len(flat), 2)]
+
+
+def rle(t):
+    """Runs of a tile row by row, a run may go on into the next row. One byte per run: (length - 1) << 4 | index."""
+    flat = [p for row in t for p in row]
+    out = []
+    i = 0
+    while i < len(flat):
+        n = 1
+        while n < 16 and i + n < len(flat) and flat[i + n] == flat[i]:
+            n += 1
+        out.append(((n - 1) << 4) | flat[i])
+        i += n
+    return out
+
+
+def encode(t, bpp):
+    """Returns (is_rle, bytes): the tile run-length encoded if it is smaller (16 colours only), else packed."""
+    packed = pack(t, bpp)
+    if bpp == 4:
+        runs = rle(t)
+        if len(runs) < len(packed):
+            return True, runs
+    return False, packed
+
+
+def atlas_size(encoded, palette, maps):
+    return sum(len(e) for _, e in encoded) + len(encoded) * 4 + len(palette) * 2 + sum(len(m) for _, m in maps) * 2
+
+
+def write(out_dir, tile, bpp, encoded, palette, maps):
+    tiles_x = LCD_W // tile
+    tiles_y = LCD_H // tile
+    data_size = sum(len(e) for _, e in encoded)
+    with open(os.path.join(out_dir, "face_atlas.h"), "w") as f:
+        f.write("// Generated by make_tile_atlas.py, do not edit\n\n")
+        f.write("#pragma once\n\n#include <stdint.h>\n\n")
+        f.write("#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n")
+        f.write("#define FACE_TILE_SIZE %d\n" % tile)
+        f.write("#define FACE_TILES_X %d\n" % tiles_x)
+        f.write("#define FACE_TILES_Y %d\n" % tiles_y)
+        f.write("#define FACE_TILES_NUM %d\n" % len(encoded))
+        f.write("#define FACE_TILE_MIRROR 0x%04X\n" % MIRROR_FLAG)
+        f.write("#define FACE_TILE_BPP %d\n" % bpp)
+        f.write("#define FACE_TILE_RLE 0x%08XUL\n" % RLE_FLAG)
+        f.write("#define FACE_TILE_DATA_SIZE %d\n" % data_size)
+        f.write("#define FACE_PALETTE_SIZE %d\n\n" % len(palette))
+        f.write("extern const uint16_t face_palette[FACE_PALETTE_SIZE];\n")
+        f.write("// Offset of every tile in face_tile_data, FACE_TILE_RLE set - the tile is run-length encoded\n")
+        f.write("extern const uint32_t face_tiles[FACE_TILES_NUM];\n")
+        f.write("extern const uint8_t face_tile_data[FACE_TILE_DATA_SIZE];\n")
+        for name, _ in maps:
+            f.write("extern const uint16_t %s[FACE_TILES_X * FACE_TILES_Y];\n" % name)
+        f.write("\n#ifdef __cplusplus\n}\n#endif\n")
+
+    with open(os.path.join(out_dir, "face_atlas.c"), "w") as f:
+        f.write("// Generated by make_tile_atlas.py, do not edit\n\n")
+        f.write("#include \"face_atlas.h\"\n")
+        f.write("#include \"esp_attr.h\"\n\n")
+        # Every pixel is looked up in the palette, keep it out of the flash cache
+        f.write("DRAM_ATTR const uint16_t face_palette[FACE_PALETTE_SIZE] = {\n")
+        for i in range(0, len(palette), 16):
+            f.write("    " + ",".join("0x%04x" % p for p in palette[i:i + 16]) + ",\n")
+        f.write("};\n\n")
+        f.write("const uint32_t face_tiles[FACE_TILES_NUM] = {\n")
+        offset = 0
+        for is_rle, e in encoded:
+            f.write("    0x%08x,\n" % (offset | (RLE_FLAG if is_rle else 0)))
+            offset += len(e)
+        f.write("};\n\n")
+        f.write("const uint8_t face_tile_data[FACE_TILE_DATA_SIZE] = {\n")
+        for _, e in encoded:
+            f.write("    " + ",".join("0x%02x" % b for b in e) + ",\n")
+        f.write("};\n")
+        for name, m in maps:
+            f.write("\nconst uint16_t %s[FACE_TILES_X * FACE_TILES_Y] = {\n" % name)
+            for ty in range(tiles_y):
+                row = m[ty * tiles_x:(ty + 1) * tiles_x]
+                f.write("    " + ",".join("0x%04x" % i for i in row) + ",\n")
+            f.write("};\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--out-dir", required=True)
+    parser.add_argument("--tile", type=int, default=16, help="tile size, must divide 320 and 240")
+    parser.add_argument("--margin", type=int, default=8, help="margin of the images around the visible part")
+    parser.add_argument("--colors", type=int, default=16, choices=(16, 256),
+                        help="size of the shared palette: 16 - 4 bits per pixel, 256 - 8 bits per pixel")
+    parser.add_argument("images", nargs="+")
+    args = parser.parse_args()
+
+    if LCD_W % args.tile or LCD_H % args.tile:
+        sys.exit("make_tile_atlas.py: tile size %d does not divide %dx%d" % (args.tile, LCD_W, LCD_H))
+
+    bpp = 4 if args.colors == 16 else 8
+    palette, pixels = load_quantized(args.images, args.margin, args.colors)
+    faces = [(map_name(p), px) for p, px in zip(args.images, pixels)]
+    atlas, maps = build(faces, args.tile)
+    encoded = [encode(t, bpp) for t in atlas.tiles]
+    write(args.out_dir, args.tile, bpp, encoded, palette, maps)
+
+    total = len(faces) * (LCD_W // args.tile) * (LCD_H // args.tile)
+    size = atlas_size(encoded, palette, maps)
+    jpeg_size = sum(os.path.getsize(p) for p in args.images)
+    print("Tile atlas: %d of %d tiles unique (%d run-length encoded), %d bytes; the JPEG files: %d bytes" %
+          (len(atlas.tiles), total, sum(1 for r, _ in encoded if r), size, jpeg_size))
+    if size > jpeg_size:
+        print("make_tile_atlas.py: warning: the atlas takes more flash than the JPEG files")
+
+
+if __name__ == "__main__":
+    main()